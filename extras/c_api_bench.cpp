@@ -0,0 +1,146 @@
+#include <chrono>                   // Timing
+#include <string>                   // Standard string operations
+#include <vector>                   // Caller-owned output buffer
+#include <cstdlib>                  // std::atoi()
+#include <iomanip>                  // Format the results table
+#include <iostream>                 // Standard IO operations
+
+#include "../motion.h"
+#include "../motion_extractor.h"
+
+#include <opencv2/core.hpp>
+
+// Times the same synthetic clip through the C++ API and the C API, so that the cost of the C boundary can be told
+// apart from the cost of processing. Usage: c_api_bench [WIDTH HEIGHT FRAMES]
+
+const int distinctFrames = 16;      // Frames are cycled from this many, so generating them isn't timed
+const double offsetFrames = 2;
+
+std::vector<cv::Mat> makeFrames(int width, int height);
+double timeCppPull(const std::vector<cv::Mat>& frames, int frameCount, unsigned long& sink);
+double timeCppCallback(const std::vector<cv::Mat>& frames, int frameCount, unsigned long& sink);
+double timeCGetFrame(const std::vector<cv::Mat>& frames, int frameCount, unsigned long& sink);
+double timeCCallback(const std::vector<cv::Mat>& frames, int frameCount, unsigned long& sink);
+void addToSink(void* user, const unsigned char* pixels, size_t stride, unsigned long frameIndex);
+void printRow(const std::string& name, double seconds, double baseline, int frameCount);
+
+
+int main(int argc, char* argv[]) {
+    int width = argc > 3 ? std::atoi(argv[1]) : 1280;
+    int height = argc > 3 ? std::atoi(argv[2]) : 720;
+    int frameCount = argc > 3 ? std::atoi(argv[3]) : 600;
+    if (width <= 0 || height <= 0 || frameCount <= 0) {
+        std::cerr << "Usage: " << argv[0] << " [WIDTH HEIGHT FRAMES]" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    std::vector<cv::Mat> frames = makeFrames(width, height);
+    unsigned long sink = 0;         // Reads every output so that nothing is optimized away
+
+    // Each pair is run twice and the second run is kept, so both see warm caches and a warm allocator
+    double cppPull = 0, cGetFrame = 0, cppCallback = 0, cCallback = 0;
+    for (int run = 0; run < 2; ++run) {
+        cppPull = timeCppPull(frames, frameCount, sink);
+        cGetFrame = timeCGetFrame(frames, frameCount, sink);
+        cppCallback = timeCppCallback(frames, frameCount, sink);
+        cCallback = timeCCallback(frames, frameCount, sink);
+    }
+
+    std::cout << width << "x" << height << ", " << frameCount << " frames, offset " << offsetFrames << std::endl;
+    printRow("C++ pull()", cppPull, cppPull, frameCount);
+    printRow("C motion_get_frame()", cGetFrame, cppPull, frameCount);
+    printRow("C++ callback", cppCallback, cppCallback, frameCount);
+    printRow("C callback", cCallback, cppCallback, frameCount);
+    std::cout << "(checksum " << sink << ")" << std::endl;
+    return 0;
+}
+
+
+std::vector<cv::Mat> makeFrames(int width, int height) {
+    // A gradient with a bright square that moves a few pixels per frame
+    std::vector<cv::Mat> frames;
+    for (int i = 0; i < distinctFrames; ++i) {
+        cv::Mat frame(height, width, CV_8UC3);
+        for (int y = 0; y < height; ++y) {
+            unsigned char* row = frame.ptr<unsigned char>(y);
+            for (int x = 0; x < width; ++x) {
+                bool inSquare = x / 64 == i % (width / 64 + 1) && y < 64;
+                row[3 * x] = static_cast<unsigned char>(inSquare ? 255 : x);
+                row[3 * x + 1] = static_cast<unsigned char>(inSquare ? 255 : y);
+                row[3 * x + 2] = static_cast<unsigned char>(inSquare ? 255 : x + y);
+            }
+        }
+        frames.push_back(frame);
+    }
+    return frames;
+}
+
+
+double timeCppPull(const std::vector<cv::Mat>& frames, int frameCount, unsigned long& sink) {
+    MotionExtractor extractor(frames[0].size(), 30, offsetFrames);
+    cv::Mat output;
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < frameCount; ++i) {
+        extractor.push(frames[i % distinctFrames]);
+        while (extractor.pull(output)) sink += output.data[0];
+    }
+    extractor.finish();
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+
+double timeCppCallback(const std::vector<cv::Mat>& frames, int frameCount, unsigned long& sink) {
+    MotionExtractor extractor(frames[0].size(), 30, offsetFrames);
+    extractor.setCallback([&sink](const cv::Mat& frame, unsigned long) { sink += frame.data[0]; });
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < frameCount; ++i) extractor.push(frames[i % distinctFrames]);
+    extractor.finish();
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+
+double timeCGetFrame(const std::vector<cv::Mat>& frames, int frameCount, unsigned long& sink) {
+    motion_extractor* extractor = motion_create(frames[0].cols, frames[0].rows, 30, offsetFrames, nullptr);
+    int width, height, channels;
+    motion_output_format(extractor, &width, &height, &channels);
+    size_t stride = static_cast<size_t>(width) * channels;
+    std::vector<unsigned char> output(stride * height);     // Caller-owned, written in place
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < frameCount; ++i) {
+        const cv::Mat& frame = frames[i % distinctFrames];
+        motion_push_frame(extractor, frame.data, frame.step[0]);
+        while (motion_get_frame(extractor, output.data(), stride, nullptr) > 0) sink += output[0];
+    }
+    motion_finish(extractor);
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    motion_destroy(extractor);
+    return seconds;
+}
+
+
+double timeCCallback(const std::vector<cv::Mat>& frames, int frameCount, unsigned long& sink) {
+    motion_extractor* extractor = motion_create(frames[0].cols, frames[0].rows, 30, offsetFrames, nullptr);
+    motion_set_callback(extractor, addToSink, &sink);
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < frameCount; ++i) {
+        const cv::Mat& frame = frames[i % distinctFrames];
+        motion_push_frame(extractor, frame.data, frame.step[0]);
+    }
+    motion_finish(extractor);
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    motion_destroy(extractor);
+    return seconds;
+}
+
+
+void addToSink(void* user, const unsigned char* pixels, size_t, unsigned long) {
+    *static_cast<unsigned long*>(user) += pixels[0];
+}
+
+
+void printRow(const std::string& name, double seconds, double baseline, int frameCount) {
+    std::cout << std::left << std::setw(24) << name << std::right << std::fixed << std::setprecision(3)
+              << std::setw(10) << seconds * 1000 / frameCount << " ms/frame"
+              << std::setw(9) << std::showpos << std::setprecision(1) << (seconds / baseline - 1) * 100 << "%"
+              << std::noshowpos << std::endl;
+}
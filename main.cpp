@@ -0,0 +1,1032 @@
+#include <cstdio>                   // std::sscanf() for --roi, --preview and --dead-zone
+#include <cstdlib>                  // std::exit(), std::atexit()
+#include <string>                   // Standard string operations
+#include <deque>                    // --multi streams waiting for the memory budget
+#include <mutex>                    // Guards the --multi memory budget
+#include <atomic>                   // --multi stream state read by SIGUSR1 reports
+#include <chrono>                   // How often --multi checks for SIGUSR1
+#include <memory>                   // std::unique_ptr for --multi streams and their extractors
+#include <thread>                   // std::thread::hardware_concurrency() for --multi
+#include <vector>                   // --roi rectangles
+#include <utility>                  // std::pair of --multi paths
+#include <algorithm>                // std::min(), std::max()
+#include <csignal>                  // SIGUSR1 requests a progress report
+#include <sstream>                  // --multi progress reports
+#include <iostream>                 // Standard IO operations
+#include <exception>                // Errors the extractor reports
+#include <fcntl.h>                  // Validate the --progress-fd descriptor
+#include <getopt.h>                 // Parse arguments with getopt_long
+#include <unistd.h>                 // Parse arguments with getopt
+
+#include "motion_extraction.h"      // Borders, statistics and instrumentation
+#include "motion_extractor.h"       // The frame pipeline
+#include "work_pool.h"              // Shared worker threads for --multi
+
+#include <opencv2/videoio.hpp>
+#include <opencv2/imgcodecs.hpp>
+
+struct arguments {                  // parseArgs() returns this struct
+    std::string inputPath;
+    std::string outputPath;
+    std::string tracePath;
+    double progressInterval = 0;    // Seconds between progress reports, 0 disables periodic reports
+    int progressFD = -1;            // Write progress as JSON lines to this descriptor instead of stderr
+    std::string metricsPath;        // Prometheus textfile collector output
+    int metricsPort = 0;            // Serve Prometheus metrics on 127.0.0.1:metricsPort
+    double metricsInterval = 10;    // Seconds between rewrites of metricsPath
+    bool stats = false;             // Print per-stage timing and hardware counters at the end
+    std::string motionStatsPath;    // Per-frame motion statistics sidecar, CSV if the name ends in .csv
+    double gateThreshold = -1;      // Only encode frames whose mean absolute difference reaches this, -1 encodes everything
+    int preRoll = 0;                // Frames kept before the start of each gated segment
+    int postRoll = 0;               // Frames kept after the end of each gated segment
+    double sparseThreshold = -1;    // Only process tiles whose sampled difference exceeds this, -1 processes every pixel
+    std::vector<cv::Rect> rois;     // Only process these rectangles. Empty means the whole frame
+    std::string maskPath;           // Only process pixels where this image is not black
+    int autocropFrames = 0;         // Detect letterbox/pillarbox bars over this many frames, 0 disables detection
+    bool autocropDrop = false;      // Leave the detected bars out of the output instead of restoring them
+    int previewLevels = 0;          // Halve the resolution this many times for a quick preview, 0 keeps full size
+    int step = 1;                   // Only output every step-th frame, from --step or --preview
+    int timelapseWindow = 0;        // Collapse this many motion frames into each output frame, 0 disables --timelapse
+    std::string timelapseMode = "max";  // How the window is collapsed: max or mean
+    std::string heatmapPath;        // Write an image of how often each pixel moved here
+    int heatmapScale = 1;           // Divide the heatmap size by this power of two
+    bool heatmapOnly = false;       // Only write the heatmap, no output video
+    std::string maskStreamPath;     // Write the motion mask of every frame to this run-length coded stream
+    std::string blobsPath;          // Write the connected regions of motion of every frame here as JSON lines
+    int blobScale = 4;              // Label blocks of this many pixels square
+    double sceneCutThreshold = -1;  // Mean absolute difference that can start a scene cut, -1 disables detection
+    std::string sceneCutMode = "gray";  // What to output until the buffer refills after a cut: gray or skip
+    double adaptiveSigmas = -1;     // Raise the overlay threshold to this many noise sigmas above the floor, -1 disables
+    int blurRadius = 1;             // Radius of the overlay mask blur, 0 disables it
+    int deadZone = 0;               // Snap motion within this distance of neutral to neutral, 0 disables the dead zone
+    int deadZoneHold = -1;          // Smaller distance for pixels that moved in the previous frame, -1 disables hysteresis
+    bool gray = false;              // Compare and write luma only
+    bool multi = false;             // Process several streams at once, given as input/output path pairs
+    std::vector<std::pair<std::string, std::string>> streams;   // Input and output path of each --multi stream
+    int threads = 0;                // Worker threads of --multi, 0 is one per core
+    long long memoryBudget = 0;     // MiB the running --multi streams may project to use together, 0 is unlimited
+    int framesToSkip = 0;
+    double secondsToSkip = 0;
+    bool framesOption = false;
+    bool secondsOption = false;
+    bool overlay = false;
+};
+
+enum longOnlyOptions {              // getopt_long() values for options that have no short form
+    OPT_PROGRESS_FD = 256,
+    OPT_METRICS_FILE,
+    OPT_METRICS_PORT,
+    OPT_METRICS_INTERVAL,
+    OPT_STATS,
+    OPT_MOTION_STATS,
+    OPT_GATE,
+    OPT_PRE_ROLL,
+    OPT_POST_ROLL,
+    OPT_SPARSE,
+    OPT_ROI,
+    OPT_MASK,
+    OPT_AUTOCROP,
+    OPT_AUTOCROP_DROP,
+    OPT_PREVIEW,
+    OPT_STEP,
+    OPT_TIMELAPSE,
+    OPT_HEATMAP,
+    OPT_HEATMAP_SCALE,
+    OPT_HEATMAP_ONLY,
+    OPT_MASK_STREAM,
+    OPT_BLOBS,
+    OPT_BLOB_SCALE,
+    OPT_SCENE_CUT,
+    OPT_ADAPTIVE_THRESHOLD,
+    OPT_BLUR,
+    OPT_DEAD_ZONE,
+    OPT_GRAY,
+    OPT_MULTI,
+    OPT_THREADS,
+    OPT_MEMORY_BUDGET
+};
+
+enum streamStatus {                 // Where a stream of --multi is, for SIGUSR1 reports
+    STREAM_WAITING,                 // Held back by --memory-budget
+    STREAM_RUNNING,
+    STREAM_DONE,
+    STREAM_FAILED
+};
+
+const char* const streamStatusNames[] = {"waiting", "running", "done", "failed"};
+
+struct streamJob {                  // One stream of --multi: its files, its extractor and where it is
+    std::string inputPath;
+    std::string outputPath;
+    cv::VideoCapture inputVideo;
+    cv::VideoWriter outputVideo;
+    MotionExtractor::options settings;  // The command line's options with this stream's borders
+    cv::Size videoSize;
+    double fps = 0;
+    double offsetFrames = 0;
+    bool failed = false;            // The extractor reported an error and the stream was stopped
+    long long memoryBytes = 0;      // Projected use, held against --memory-budget while the stream runs
+    std::unique_ptr<MotionExtractor> extractor;     // Created when the stream is admitted
+    cv::Mat decodedFrame;
+    unsigned long frameIndex = 0;
+    long long frameStartNs = 0;     // When the current frame's decode started, for the latency metric
+    long long reportedDepth = 0;    // Delay buffer depth last added to the queue depth metric
+    double totalFrames = 0;         // CAP_PROP_FRAME_COUNT, which may be 0 or an estimate for some containers
+
+    // Written by the worker moving the stream on and read by SIGUSR1 reports on the main thread
+    std::atomic<int> status{STREAM_WAITING};
+    std::atomic<unsigned long> framesDecoded{0};
+    std::atomic<size_t> bufferSize{0};
+    std::atomic<size_t> bufferCapacity{0};
+};
+
+struct streamScheduler {            // Starts waiting streams of --multi whenever the memory budget allows
+    workPool* pool;
+    long long budgetBytes = 0;      // 0 is unlimited
+    long long usedBytes = 0;        // Projected use of the running streams
+    std::mutex mutex;               // Guards usedBytes and waiting
+    std::deque<streamJob*> waiting; // In command line order
+};
+
+arguments parseArgs(int argc, char* argv[]);
+MotionExtractor::options extractorOptions(const arguments& args);
+double resolveOffset(const arguments& args, const std::string& inputPath, double fps, double frameCount);
+void extractMotion(cv::VideoCapture& inputVideo, cv::VideoWriter& outputVideo, MotionExtractor& extractor);
+void extractMotionStreams(const arguments& args);
+void openStream(streamJob& job, const arguments& args);
+void admitStreams(streamScheduler& scheduler);
+void startStream(streamScheduler& scheduler, streamJob& job);
+void stepStream(streamScheduler& scheduler, streamJob& job);
+void finishStream(streamScheduler& scheduler, streamJob& job);
+void reportStreams(const std::vector<std::unique_ptr<streamJob>>& jobs);
+
+int main(int argc, char* argv[]) {
+    // Route every cv::Mat allocation through the counting allocator for the memory report
+    matAllocator.inner = cv::Mat::getDefaultAllocator();
+    cv::Mat::setDefaultAllocator(&matAllocator);
+
+    arguments args = parseArgs(argc, argv);
+
+    // The trace is finished when the program exits so that runs ending in an error still produce one
+    if (!args.tracePath.empty()) {
+        if (!startTrace(args.tracePath)) {
+            std::cerr << "Error: Could not write the trace file " << args.tracePath << std::endl;
+            std::exit(EXIT_FAILURE);
+        }
+        std::atexit(writeTrace);
+    }
+
+    progressInterval = args.progressInterval;
+    progressFD = args.progressFD;
+    if (progressFD >= 0 && progressInterval == 0) progressInterval = 5;
+
+    // SIGUSR1 prints a progress report on demand, even when periodic reports are off
+    struct sigaction action = {};
+    action.sa_handler = requestProgress;
+    action.sa_flags = SA_RESTART;   // Don't interrupt the decoder's reads
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGUSR1, &action, nullptr);
+
+    if (!args.metricsPath.empty() || args.metricsPort > 0) startMetrics(args.metricsPath, args.metricsPort, args.metricsInterval);
+
+    if (args.stats) openHardwareCounters();
+
+    if (args.multi) {
+        extractMotionStreams(args);
+        return 0;
+    }
+
+    cv::VideoCapture inputVideo(args.inputPath);
+
+    if (!inputVideo.isOpened()) {
+        std::cerr << "Error: Could not open file " << args.inputPath << std::endl;
+        std::exit(EXIT_FAILURE);
+    }
+
+    // Stats about the input video for creating the output video stream
+    int videoWidth = static_cast<int>(inputVideo.get(cv::CAP_PROP_FRAME_WIDTH));
+    int videoHeight = static_cast<int>(inputVideo.get(cv::CAP_PROP_FRAME_HEIGHT));
+    double fps = inputVideo.get(cv::CAP_PROP_FPS);
+    double frameCount = inputVideo.get(cv::CAP_PROP_FRAME_COUNT);
+    int fourcc = cv::VideoWriter::fourcc('a', 'v', 'c', '1');
+
+    double offsetFrames = resolveOffset(args, args.inputPath, fps, frameCount);
+
+    // Letterbox and pillarbox bars are left out of processing. They are restored in the output unless --autocrop-drop
+    MotionExtractor::options settings = extractorOptions(args);
+    if (args.autocropFrames > 0) settings.content = detectBorders(args.inputPath, args.autocropFrames, cv::Size(videoWidth, videoHeight));
+    // Always collected here: SIGUSR1 can ask for a progress report, which shows the memory use
+    extractorStats runStats;
+    settings.stats = &runStats;
+    if (settings.gateThreshold >= 0) settings.gateIndexPath = args.outputPath + ".segments.csv";
+
+    // The extractor opens the sidecars and reports what it can't write
+    MotionExtractor extractor;
+    try {
+        extractor.start(cv::Size(videoWidth, videoHeight), fps, offsetFrames, settings);
+    } catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        std::exit(EXIT_FAILURE);
+    }
+    warnIfMemoryShort(extractor.projectedMemory());
+    extractor.setSceneCutCallback([](unsigned long frameIndex, double seconds) {
+        std::cerr << "Scene cut at frame " << frameIndex << " (" << seconds << " s)" << std::endl;
+    });
+
+    // With --heatmap-only nothing is encoded and the writer stays closed
+    cv::VideoWriter outputVideo;
+    // With --gray the writer is opened for monochrome frames. Codecs without a gray pixel format get constant chroma
+    if (!args.heatmapOnly) outputVideo.open(args.outputPath, fourcc, fps, extractor.outputSize(), !args.gray);
+    
+    if (!args.heatmapOnly && !outputVideo.isOpened()) {
+        std::cerr << "Error: Could not create the output video file " << args.outputPath << std::endl;
+        std::exit(EXIT_FAILURE);
+    }
+    
+    try {
+        extractMotion(inputVideo, outputVideo, extractor);
+    } catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        std::exit(EXIT_FAILURE);
+    }
+
+    if (args.stats) {
+        outputVideo.release();          // Flush the encoder so the file size covers every frame
+        printStats(runStats, settings, args.heatmapOnly ? "" : args.outputPath, fps);
+    }
+
+    return 0;
+}
+
+
+arguments parseArgs(int argc, char* argv[]) {
+    auto printUsage = [](const std::string& programName) {
+        std::cout << "Usage: " << programName << " input_path output_path [-f frames | -s seconds] [options]" \
+        << std::endl;
+        std::cout << "       " << programName << " --multi input_path output_path [input_path output_path ...] [-f frames | -s seconds] [options]" \
+        << std::endl;
+    };
+
+    auto printHelp = [&printUsage](const std::string& programName) {
+        printUsage(programName);
+        std::cout << "\nArguments:" << std::endl;
+        std::cout << "  input_path         Path to input video file (MP4)" << std::endl;
+        std::cout << "  output_path        Path of output video file to save (MP4)" << std::endl;
+        std::cout << "\nOptions:" << std::endl;
+        std::cout << "  -f, --frames       Number of frames to offset by" << std::endl;
+        std::cout << "  -s, --seconds      Number of seconds to offset by. May be fractional, like 0.5" << std::endl;
+        std::cout << "  -o, --overlay      Overlay the extracted motion over the original video" << std::endl;
+        std::cout << "  -t, --trace        Write a per-frame, per-stage timeline to a Chrome trace JSON file (opens in Perfetto)" << std::endl;
+        std::cout << "  -p, --progress     Report progress to stderr every given number of seconds" << std::endl;
+        std::cout << "      --progress-fd  Write progress reports as JSON lines to this file descriptor" << std::endl;
+        std::cout << "      --metrics-file  Periodically rewrite this file with Prometheus metrics (textfile collector)" << std::endl;
+        std::cout << "      --metrics-port  Serve Prometheus metrics over HTTP on this port of 127.0.0.1" << std::endl;
+        std::cout << "      --metrics-interval  Seconds between rewrites of the metrics file (default 10)" << std::endl;
+        std::cout << "      --stats        Print per-stage time, IPC and cache/branch misses per pixel, and memory use at the end" << std::endl;
+        std::cout << "      --motion-stats  Write per-frame motion statistics to a binary file, or CSV if the name ends in .csv" << std::endl;
+        std::cout << "      --gate         Only encode frames whose mean absolute difference is at least this value" << std::endl;
+        std::cout << "      --pre-roll     Frames to keep before each gated segment (default 0)" << std::endl;
+        std::cout << "      --post-roll    Frames to keep after each gated segment (default 0)" << std::endl;
+        std::cout << "      --sparse       Only process 16x16 tiles whose sampled mean difference exceeds this value" << std::endl;
+        std::cout << "      --roi          Only process the rectangle x,y,width,height. Can be given more than once" << std::endl;
+        std::cout << "      --mask         Only process pixels where this image is not black" << std::endl;
+        std::cout << "      --autocrop     Detect black bars over this many frames at the start and skip processing them" << std::endl;
+        std::cout << "      --autocrop-drop  Leave the detected bars out of the output video" << std::endl;
+        std::cout << "      --step         Only output every N-th frame. The offset still counts every input frame" << std::endl;
+        std::cout << "      --timelapse    W[:max|mean] Collapse every W motion frames into one output frame (default max)" << std::endl;
+        std::cout << "      --heatmap      Write an image of how often each pixel moved over the whole video" << std::endl;
+        std::cout << "      --heatmap-scale  Divide the heatmap size by 1, 2, 4, 8 or 16 (default 1)" << std::endl;
+        std::cout << "      --heatmap-only  Only write the heatmap. The output video path is then left out" << std::endl;
+        std::cout << "      --mask-stream  Write the motion mask of every frame to a compact binary stream" << std::endl;
+        std::cout << "      --blobs        Write the bounding box, area and centroid of each region of motion as JSON lines" << std::endl;
+        std::cout << "      --blob-scale   Find regions on blocks of 1, 2, 4, 8 or 16 pixels square (default 4)" << std::endl;
+        std::cout << "      --scene-cut    T[:gray|skip] Restart the offset at hard cuts whose mean difference reaches T" << std::endl;
+        std::cout << "      --adaptive-threshold  Raise the overlay threshold to this many noise sigmas above the noise floor" << std::endl;
+        std::cout << "      --blur         Radius of the box blur on the overlay mask, 0 to 63 (default 1)" << std::endl;
+        std::cout << "      --dead-zone    K[:H] Snap motion within K of neutral gray to neutral. H keeps moving pixels moving" << std::endl;
+        std::cout << "      --gray         Compare luma only and write a monochrome video" << std::endl;
+        std::cout << "      --multi        Process every input/output path pair at once on a shared pool of threads" << std::endl;
+        std::cout << "      --threads      Worker threads for --multi (default one per core)" << std::endl;
+        std::cout << "      --memory-budget  MiB the running --multi streams may use together. Others wait their turn" << std::endl;
+        std::cout << "      --preview      LEVELS[:STEP] Halve the resolution LEVELS times and only process every STEP-th frame" << std::endl;
+        std::cout << "  -h, --help         Display this help message" << std::endl;
+        std::cout << "\nNOTE: --frames and --seconds are mutually exclusive." << std::endl;
+        std::cout << "A small offset shows fast movements in the video. A large offset shows slow movements in the video." << std::endl;
+        std::cout << "If -f or -s is set to 0, the output video shows change from the start of the video." << std::endl;
+        std::cout << "Send SIGUSR1 to print a progress report at any time, one line per stream with --multi." << std::endl;
+        std::cout << "\nExample:" << std::endl;
+        std::cout << "  " << programName << " input.mp4 output.mp4 -s 1" << std::endl;
+    };
+
+    arguments args;
+    std::string programName = argv[0];
+    int opt;
+
+    // For getopt_long() -- allows for the long and short name of the option to be given (ex. -o vs. --overlay)
+    const char* const short_opts = "f:s:ot:p:h";
+    const option long_opts[] = {
+        {"frames",  required_argument, nullptr, 'f'},
+        {"seconds", required_argument, nullptr, 's'},
+        {"overlay", no_argument,       nullptr, 'o'},
+        {"trace",   required_argument, nullptr, 't'},
+        {"progress",    required_argument, nullptr, 'p'},
+        {"progress-fd", required_argument, nullptr, OPT_PROGRESS_FD},
+        {"metrics-file",     required_argument, nullptr, OPT_METRICS_FILE},
+        {"metrics-port",     required_argument, nullptr, OPT_METRICS_PORT},
+        {"metrics-interval", required_argument, nullptr, OPT_METRICS_INTERVAL},
+        {"stats",   no_argument,       nullptr, OPT_STATS},
+        {"motion-stats", required_argument, nullptr, OPT_MOTION_STATS},
+        {"gate",      required_argument, nullptr, OPT_GATE},
+        {"pre-roll",  required_argument, nullptr, OPT_PRE_ROLL},
+        {"post-roll", required_argument, nullptr, OPT_POST_ROLL},
+        {"sparse",    required_argument, nullptr, OPT_SPARSE},
+        {"roi",       required_argument, nullptr, OPT_ROI},
+        {"mask",      required_argument, nullptr, OPT_MASK},
+        {"autocrop",      required_argument, nullptr, OPT_AUTOCROP},
+        {"autocrop-drop", no_argument,       nullptr, OPT_AUTOCROP_DROP},
+        {"preview",       required_argument, nullptr, OPT_PREVIEW},
+        {"step",          required_argument, nullptr, OPT_STEP},
+        {"timelapse",     required_argument, nullptr, OPT_TIMELAPSE},
+        {"heatmap",       required_argument, nullptr, OPT_HEATMAP},
+        {"heatmap-scale", required_argument, nullptr, OPT_HEATMAP_SCALE},
+        {"heatmap-only",  no_argument,       nullptr, OPT_HEATMAP_ONLY},
+        {"mask-stream",   required_argument, nullptr, OPT_MASK_STREAM},
+        {"blobs",         required_argument, nullptr, OPT_BLOBS},
+        {"blob-scale",    required_argument, nullptr, OPT_BLOB_SCALE},
+        {"scene-cut",     required_argument, nullptr, OPT_SCENE_CUT},
+        {"adaptive-threshold", required_argument, nullptr, OPT_ADAPTIVE_THRESHOLD},
+        {"blur",          required_argument, nullptr, OPT_BLUR},
+        {"dead-zone",     required_argument, nullptr, OPT_DEAD_ZONE},
+        {"gray",          no_argument,       nullptr, OPT_GRAY},
+        {"multi",         no_argument,       nullptr, OPT_MULTI},
+        {"threads",       required_argument, nullptr, OPT_THREADS},
+        {"memory-budget", required_argument, nullptr, OPT_MEMORY_BUDGET},
+        {"help",    no_argument,       nullptr, 'h'},
+        {nullptr,   no_argument,       nullptr, 0}
+    };
+    
+    // Set variables depending on command line args
+    while ((opt = getopt_long(argc, argv, short_opts, long_opts, nullptr)) != -1) {
+        switch (opt) {
+            case 'h':
+                printHelp(programName);
+                std::exit(EXIT_SUCCESS);
+            case 'f':
+                args.framesToSkip = std::stoi(optarg);
+                args.framesOption = true;
+                break;
+            case 's':
+                args.secondsToSkip = std::stod(optarg);
+                args.secondsOption = true;
+                break;
+            case 'o':
+                args.overlay = true;
+                break;
+            case 't':
+                args.tracePath = optarg;
+                break;
+            case 'p':
+                args.progressInterval = std::stod(optarg);
+                break;
+            case OPT_PROGRESS_FD:
+                args.progressFD = std::stoi(optarg);
+                break;
+            case OPT_METRICS_FILE:
+                args.metricsPath = optarg;
+                break;
+            case OPT_METRICS_PORT:
+                args.metricsPort = std::stoi(optarg);
+                break;
+            case OPT_METRICS_INTERVAL:
+                args.metricsInterval = std::stod(optarg);
+                break;
+            case OPT_STATS:
+                args.stats = true;
+                break;
+            case OPT_MOTION_STATS:
+                args.motionStatsPath = optarg;
+                break;
+            case OPT_GATE:
+                args.gateThreshold = std::stod(optarg);
+                break;
+            case OPT_PRE_ROLL:
+                args.preRoll = std::stoi(optarg);
+                break;
+            case OPT_POST_ROLL:
+                args.postRoll = std::stoi(optarg);
+                break;
+            case OPT_SPARSE:
+                args.sparseThreshold = std::stod(optarg);
+                break;
+            case OPT_ROI: {
+                cv::Rect roi;
+                if (std::sscanf(optarg, "%d,%d,%d,%d", &roi.x, &roi.y, &roi.width, &roi.height) != 4 \
+                    || roi.x < 0 || roi.y < 0 || roi.width <= 0 || roi.height <= 0) {
+                    std::cerr << "Error: --roi expects x,y,width,height with a positive size." << std::endl;
+                    std::exit(EXIT_FAILURE);
+                }
+                args.rois.push_back(roi);
+                break;
+            }
+            case OPT_MASK:
+                args.maskPath = optarg;
+                break;
+            case OPT_AUTOCROP:
+                args.autocropFrames = std::stoi(optarg);
+                break;
+            case OPT_AUTOCROP_DROP:
+                args.autocropDrop = true;
+                break;
+            case OPT_STEP:
+                args.step = std::stoi(optarg);
+                break;
+            case OPT_TIMELAPSE: {
+                std::string value = optarg;
+                size_t separator = value.find(':');
+                args.timelapseWindow = std::stoi(value.substr(0, separator));
+                if (separator != std::string::npos) args.timelapseMode = value.substr(separator + 1);
+                break;
+            }
+            case OPT_HEATMAP:
+                args.heatmapPath = optarg;
+                break;
+            case OPT_HEATMAP_SCALE:
+                args.heatmapScale = std::stoi(optarg);
+                break;
+            case OPT_HEATMAP_ONLY:
+                args.heatmapOnly = true;
+                break;
+            case OPT_MASK_STREAM:
+                args.maskStreamPath = optarg;
+                break;
+            case OPT_BLOBS:
+                args.blobsPath = optarg;
+                break;
+            case OPT_BLOB_SCALE:
+                args.blobScale = std::stoi(optarg);
+                break;
+            case OPT_SCENE_CUT: {
+                std::string value = optarg;
+                size_t separator = value.find(':');
+                args.sceneCutThreshold = std::stod(value.substr(0, separator));
+                if (separator != std::string::npos) args.sceneCutMode = value.substr(separator + 1);
+                break;
+            }
+            case OPT_ADAPTIVE_THRESHOLD:
+                args.adaptiveSigmas = std::stod(optarg);
+                break;
+            case OPT_BLUR:
+                args.blurRadius = std::stoi(optarg);
+                break;
+            case OPT_DEAD_ZONE: {
+                char separator = 0;
+                int fields = std::sscanf(optarg, "%d%c%d", &args.deadZone, &separator, &args.deadZoneHold);
+                if (fields != 1 && (fields != 3 || separator != ':')) {
+                    std::cerr << "Error: --dead-zone expects K or K:H, got " << optarg << std::endl;
+                    std::exit(EXIT_FAILURE);
+                }
+                break;
+            }
+            case OPT_GRAY:
+                args.gray = true;
+                break;
+            case OPT_MULTI:
+                args.multi = true;
+                break;
+            case OPT_THREADS:
+                args.threads = std::stoi(optarg);
+                break;
+            case OPT_MEMORY_BUDGET:
+                args.memoryBudget = std::stoll(optarg);
+                break;
+            case OPT_PREVIEW: {
+                char separator = 0;
+                int fields = std::sscanf(optarg, "%d%c%d", &args.previewLevels, &separator, &args.step);
+                if (fields != 1 && (fields != 3 || separator != ':')) {
+                    std::cerr << "Error: --preview expects LEVELS or LEVELS:STEP, got " << optarg << std::endl;
+                    std::exit(EXIT_FAILURE);
+                }
+                break;
+            }
+            case '?':
+                std::cerr << "Unknown option: " << static_cast<char>(optopt) << std::endl;
+                printUsage(programName);
+                std::exit(EXIT_FAILURE);
+            default:
+                break;
+        }
+    }
+
+    // The user may not provide both --frames and --seconds
+    if (args.framesOption && args.secondsOption) {
+        std::cerr << "Error: Options -f and -s are mutually exclusive." << std::endl;
+        printUsage(programName);
+        std::exit(EXIT_FAILURE);
+    }
+
+    // Either --frames or --seconds must be provided
+    if (!args.framesOption && !args.secondsOption) {
+        std::cerr << "Error: You must provide either a seconds or frames offset with -s or -f." << std::endl;
+        printUsage(programName);
+        std::exit(EXIT_FAILURE);
+    }
+
+    if (args.framesToSkip < 0) {
+        std::cerr << "Frames must be a positive number." << std::endl;
+        std::exit(EXIT_FAILURE);
+    }
+
+    if (args.secondsToSkip < 0) {
+        std::cerr << "Seconds must be a positive number." << std::endl;
+        std::exit(EXIT_FAILURE);
+    }
+
+    if (args.progressInterval < 0) {
+        std::cerr << "Progress interval must be a positive number." << std::endl;
+        std::exit(EXIT_FAILURE);
+    }
+
+    if (args.progressFD >= 0 && fcntl(args.progressFD, F_GETFD) == -1) {
+        std::cerr << "Error: File descriptor " << args.progressFD << " is not open." << std::endl;
+        std::exit(EXIT_FAILURE);
+    }
+
+    if (args.metricsPort < 0 || args.metricsPort > 65535) {
+        std::cerr << "Metrics port must be between 1 and 65535." << std::endl;
+        std::exit(EXIT_FAILURE);
+    }
+
+    if (args.metricsInterval <= 0) {
+        std::cerr << "Metrics interval must be a positive number." << std::endl;
+        std::exit(EXIT_FAILURE);
+    }
+
+    if (args.preRoll < 0 || args.postRoll < 0) {
+        std::cerr << "Pre-roll and post-roll must be positive numbers." << std::endl;
+        std::exit(EXIT_FAILURE);
+    }
+
+    if ((args.preRoll > 0 || args.postRoll > 0) && args.gateThreshold < 0) {
+        std::cerr << "Error: --pre-roll and --post-roll require --gate." << std::endl;
+        printUsage(programName);
+        std::exit(EXIT_FAILURE);
+    }
+
+    if (args.autocropFrames < 0) {
+        std::cerr << "Autocrop frames must be a positive number." << std::endl;
+        std::exit(EXIT_FAILURE);
+    }
+
+    if (args.autocropDrop && args.autocropFrames == 0) {
+        std::cerr << "Error: --autocrop-drop requires --autocrop." << std::endl;
+        printUsage(programName);
+        std::exit(EXIT_FAILURE);
+    }
+
+    if (args.previewLevels < 0 || args.step < 1) {
+        std::cerr << "Preview levels must be a positive number and the step at least 1." << std::endl;
+        std::exit(EXIT_FAILURE);
+    }
+
+    if (args.timelapseWindow < 0 || args.timelapseWindow > maxTimelapseWindow) {
+        std::cerr << "Timelapse window must be between 1 and " << maxTimelapseWindow << " frames." << std::endl;
+        std::exit(EXIT_FAILURE);
+    }
+
+    if (args.deadZone < 0 || args.deadZone > 127 || args.deadZoneHold > args.deadZone) {
+        std::cerr << "Dead zone must be between 0 and 127, and the hysteresis distance no larger than it." << std::endl;
+        std::exit(EXIT_FAILURE);
+    }
+
+    if (args.blurRadius < 0 || args.blurRadius > maxBlurRadius) {
+        std::cerr << "Blur radius must be between 0 and " << maxBlurRadius << "." << std::endl;
+        std::exit(EXIT_FAILURE);
+    }
+
+    if (args.sceneCutMode != "gray" && args.sceneCutMode != "skip") {
+        std::cerr << "Error: Scene cut mode must be gray or skip, got " << args.sceneCutMode << std::endl;
+        std::exit(EXIT_FAILURE);
+    }
+
+    if (args.timelapseMode != "max" && args.timelapseMode != "mean") {
+        std::cerr << "Error: Timelapse mode must be max or mean, got " << args.timelapseMode << std::endl;
+        std::exit(EXIT_FAILURE);
+    }
+
+    if (args.timelapseWindow > 0 && args.gateThreshold >= 0) {
+        std::cerr << "Error: Options --timelapse and --gate are mutually exclusive." << std::endl;
+        printUsage(programName);
+        std::exit(EXIT_FAILURE);
+    }
+
+    if (args.heatmapScale != 1 && args.heatmapScale != 2 && args.heatmapScale != 4 && args.heatmapScale != 8 \
+        && args.heatmapScale != 16) {
+        std::cerr << "Heatmap scale must be 1, 2, 4, 8 or 16." << std::endl;
+        std::exit(EXIT_FAILURE);
+    }
+
+    if (args.blobScale != 1 && args.blobScale != 2 && args.blobScale != 4 && args.blobScale != 8 && args.blobScale != 16) {
+        std::cerr << "Blob scale must be 1, 2, 4, 8 or 16." << std::endl;
+        std::exit(EXIT_FAILURE);
+    }
+
+    if (args.heatmapOnly && args.heatmapPath.empty()) {
+        std::cerr << "Error: --heatmap-only requires --heatmap." << std::endl;
+        printUsage(programName);
+        std::exit(EXIT_FAILURE);
+    }
+
+    if (args.heatmapOnly && args.gateThreshold >= 0) {
+        std::cerr << "Error: Options --heatmap-only and --gate are mutually exclusive." << std::endl;
+        printUsage(programName);
+        std::exit(EXIT_FAILURE);
+    }
+
+    if (args.threads < 0 || args.memoryBudget < 0) {
+        std::cerr << "Threads and memory budget must be positive numbers." << std::endl;
+        std::exit(EXIT_FAILURE);
+    }
+
+    if ((args.threads > 0 || args.memoryBudget > 0) && !args.multi) {
+        std::cerr << "Error: --threads and --memory-budget require --multi." << std::endl;
+        printUsage(programName);
+        std::exit(EXIT_FAILURE);
+    }
+
+    // These write one report or sidecar for the whole process, which several streams can't share. --gate writes its
+    // index next to each output, and --sparse picks tiles per extractor, so both work per stream
+    if (args.multi && (args.stats || args.progressInterval > 0 || args.progressFD >= 0 || !args.motionStatsPath.empty() \
+        || !args.heatmapPath.empty() || !args.maskStreamPath.empty() || !args.blobsPath.empty())) {
+        std::cerr << "Error: --multi can't be combined with --stats, --progress, --progress-fd, --motion-stats, " \
+        << "--heatmap, --mask-stream or --blobs." << std::endl;
+        printUsage(programName);
+        std::exit(EXIT_FAILURE);
+    }
+
+    // --heatmap-only doesn't write a video, so the output path is left out
+    if (args.multi) {
+        if (optind == argc || (argc - optind) % 2 != 0) {
+            std::cerr << "Error: Expected pairs of input and output file paths." << std::endl;
+            printUsage(programName);
+            std::exit(EXIT_FAILURE);
+        }
+        for (int i = optind; i < argc; i += 2) args.streams.emplace_back(argv[i], argv[i + 1]);
+    } else if (args.heatmapOnly && optind + 1 == argc) {
+        args.inputPath = argv[optind];
+    } else if (optind + 2 != argc) {
+        std::cerr << "Error: Expected input and output file paths." << std::endl;
+        printUsage(programName);
+        std::exit(EXIT_FAILURE);
+    } else {
+        args.inputPath = argv[optind];
+        args.outputPath = argv[optind + 1];
+    }
+
+    return args;
+}
+
+
+MotionExtractor::options extractorOptions(const arguments& args) {
+    // Everything but the borders, which are detected per input, and the sidecars that are named after the output
+    MotionExtractor::options settings;
+    settings.overlay = args.overlay;
+    settings.gray = args.gray;
+    settings.blurRadius = args.blurRadius;
+    settings.deadZone = args.deadZone;
+    settings.deadZoneHold = args.deadZoneHold;
+    settings.step = args.step;
+    settings.timelapseWindow = args.timelapseWindow;
+    settings.timelapseAccumulation = args.timelapseMode == "mean" ? TIMELAPSE_MEAN : TIMELAPSE_MAX;
+    settings.sceneCutThreshold = args.sceneCutThreshold;
+    settings.sceneCutSkip = args.sceneCutMode == "skip";
+    settings.adaptiveSigmas = args.adaptiveSigmas;
+    settings.sparseThreshold = args.sparseThreshold;
+    settings.gateThreshold = args.gateThreshold;
+    settings.preRoll = args.preRoll;
+    settings.postRoll = args.postRoll;
+    settings.rois = args.rois;
+    settings.dropBorders = args.autocropDrop;
+    settings.previewLevels = args.previewLevels;
+    settings.motionStatsPath = args.motionStatsPath;
+    settings.heatmapPath = args.heatmapPath;
+    settings.heatmapScale = args.heatmapScale;
+    settings.heatmapOnly = args.heatmapOnly;
+    settings.maskStreamPath = args.maskStreamPath;
+    settings.blobsPath = args.blobsPath;
+    settings.blobScale = args.blobScale;
+
+    if (!args.maskPath.empty()) {
+        settings.mask = cv::imread(args.maskPath, cv::IMREAD_GRAYSCALE);
+        if (settings.mask.empty()) {
+            std::cerr << "Error: Could not read the mask image " << args.maskPath << std::endl;
+            std::exit(EXIT_FAILURE);
+        }
+    }
+    return settings;
+}
+
+
+double resolveOffset(const arguments& args, const std::string& inputPath, double fps, double frameCount) {
+    // Ensure that the frame delay from the command line args is less than the length of the video. Live streams
+    // report no frame count and aren't checked. Returns the offset in frames
+    if (args.framesOption) {
+        unsigned long frameDelay = args.framesToSkip;
+        if (frameCount > 0 && frameDelay > frameCount) {
+            std::cerr << "Error: " << inputPath << " only has " << static_cast<int>(frameCount) << " frame(s). Cannot offset by " \
+            << frameDelay << " frame(s)." << std::endl;
+            std::exit(EXIT_FAILURE);
+        }
+        return frameDelay;
+    }
+
+    // Offsets that fall between frames compare with a mix of the two frames around them
+    unsigned long frameDelay;
+    int fraction;
+    splitOffset(args.secondsToSkip * fps, frameDelay, fraction);
+    if (frameCount > 0 && frameDelay + (fraction > 0) > frameCount) {
+        std::cerr << "Error: " << inputPath << " is only " << static_cast<int>(frameCount / fps) << " second(s) long. Cannot offset by " \
+        << args.secondsToSkip << " second(s)." << std::endl;
+        std::exit(EXIT_FAILURE);
+    }
+    return args.secondsToSkip * fps;
+}
+
+
+void extractMotion(cv::VideoCapture& inputVideo, cv::VideoWriter& outputVideo, MotionExtractor& extractor) {
+    // Decode the input, push it through the extractor and encode the motion frames it hands back. Frames the extractor
+    // doesn't use are only grabbed, which skips the conversion to BGR
+    cv::Mat decodedFrame;
+    progressState progress;
+    progress.start = progress.lastReport = std::chrono::steady_clock::now();
+    progress.totalFrames = inputVideo.get(cv::CAP_PROP_FRAME_COUNT);
+    progress.bufferCapacity = extractor.bufferCapacity();
+
+    metricsShard* metrics = metricsEnabled ? &threadMetrics() : nullptr;
+    if (metrics) metrics->queueCapacity.store(progress.bufferCapacity, std::memory_order_relaxed);
+    long long frameStartNs = 0;
+    extractorStats* stats = extractor.settings().stats;
+    progress.memory = stats != nullptr ? &stats->memory : nullptr;
+
+    // Encoding straight from the callback writes the extractor's own output frame, without a copy
+    extractor.setCallback([&](const cv::Mat& frame, unsigned long frameIndex) {
+        {
+            traceScope scope("encode", frameIndex);
+            stageScope stage(stats != nullptr ? &stats->stages[STAGE_ENCODE] : nullptr, frame.total());
+            outputVideo.write(frame);
+        }
+        if (metrics) {
+            addToCounter(metrics->framesWritten, 1);
+            recordFrameLatency(*metrics, traceNowNs() - frameStartNs);
+        }
+    });
+
+    for (unsigned long frameIndex = 0;; ++frameIndex) {
+        frameStartNs = metrics ? traceNowNs() : 0;
+        bool wanted = extractor.wants();
+        bool decoded;
+        {
+            traceScope scope("decode", frameIndex);
+            decoded = wanted ? inputVideo.read(decodedFrame) : inputVideo.grab();
+        }
+        if (!decoded) break;
+
+        if (metrics) addToCounter(metrics->framesDecoded, 1);
+        progress.framesDecoded = frameIndex + 1;
+        progress.bufferSize = extractor.buffered();
+        reportProgress(progress, false);
+        if (metrics) metrics->queueDepth.store(extractor.buffered(), std::memory_order_relaxed);
+
+        if (wanted) extractor.push(decodedFrame);
+        else extractor.skip();
+    }
+
+    extractor.finish();
+    if (progressInterval > 0) reportProgress(progress, true);
+}
+
+
+void extractMotionStreams(const arguments& args) {
+    // Every stream keeps its own extractor, and one task at a time moves it on by a frame. A stream's frames depend
+    // on each other through the delay buffer, so they run in order, while different streams run on any free worker.
+    // A stream that fails stops on its own and the others carry on
+    std::vector<std::unique_ptr<streamJob>> jobs;
+    for (const auto& paths : args.streams) {
+        jobs.emplace_back(new streamJob);
+        jobs.back()->inputPath = paths.first;
+        jobs.back()->outputPath = paths.second;
+        openStream(*jobs.back(), args);
+    }
+
+    int threads = args.threads > 0 ? args.threads : std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
+    // More workers than streams would only wait. With a stream for every worker, OpenCV's own parallel loops in the
+    // overlay blur would oversubscribe the cores, so they run serially
+    if (static_cast<int>(jobs.size()) >= threads) cv::setNumThreads(0);
+    workPool pool(std::min(threads, static_cast<int>(jobs.size())));
+
+    streamScheduler scheduler;
+    scheduler.pool = &pool;
+    scheduler.budgetBytes = args.memoryBudget << 20;
+    for (const auto& job : jobs) {
+        if (scheduler.budgetBytes > 0 && job->memoryBytes > scheduler.budgetBytes) {
+            std::cerr << "Error: " << job->inputPath << " is projected to need " << job->memoryBytes / (1 << 20) \
+            << " MiB, more than the whole memory budget. Consider a shorter offset or a larger budget." << std::endl;
+            std::exit(EXIT_FAILURE);
+        }
+        scheduler.waiting.push_back(job.get());
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(scheduler.mutex);
+        admitStreams(scheduler);
+        for (const streamJob* job : scheduler.waiting) {
+            std::cerr << "Warning: " << job->inputPath << " waits for the memory budget until another stream finishes." \
+            << std::endl;
+        }
+    }
+
+    // Each worker only sees the stream it is moving on, so the main thread services SIGUSR1 for all of them
+    while (!pool.waitFor(std::chrono::milliseconds(200))) {
+        if (progressRequested) reportStreams(jobs);
+    }
+
+    bool failed = false;
+    for (const auto& job : jobs) failed = failed || job->failed;
+    if (failed) std::exit(EXIT_FAILURE);
+}
+
+
+void openStream(streamJob& job, const arguments& args) {
+    job.inputVideo.open(job.inputPath);
+    if (!job.inputVideo.isOpened()) {
+        std::cerr << "Error: Could not open file " << job.inputPath << std::endl;
+        std::exit(EXIT_FAILURE);
+    }
+
+    int videoWidth = static_cast<int>(job.inputVideo.get(cv::CAP_PROP_FRAME_WIDTH));
+    int videoHeight = static_cast<int>(job.inputVideo.get(cv::CAP_PROP_FRAME_HEIGHT));
+    job.videoSize = cv::Size(videoWidth, videoHeight);
+    job.fps = job.inputVideo.get(cv::CAP_PROP_FPS);
+    job.totalFrames = job.inputVideo.get(cv::CAP_PROP_FRAME_COUNT);
+    job.offsetFrames = resolveOffset(args, job.inputPath, job.fps, job.totalFrames);
+
+    job.settings = extractorOptions(args);
+    if (args.autocropFrames > 0) job.settings.content = detectBorders(job.inputPath, args.autocropFrames, job.videoSize);
+    if (job.settings.gateThreshold >= 0) job.settings.gateIndexPath = job.outputPath + ".segments.csv";
+
+    // The extractor is only created once the stream is admitted, so the region is worked out here for the budget
+    activeRegion region;
+    unsigned long frameDelay;
+    int referenceFraction;
+    try {
+        buildActiveRegion(region, job.videoSize, job.settings);
+    } catch (const std::exception& e) {
+        std::cerr << "Error: " << job.inputPath << ": " << e.what() << std::endl;
+        std::exit(EXIT_FAILURE);
+    }
+    splitOffset(job.offsetFrames, frameDelay, referenceFraction);
+    job.memoryBytes = projectedMemory(frameDelay, referenceFraction, region.crop.size(), job.settings);
+
+    int fourcc = cv::VideoWriter::fourcc('a', 'v', 'c', '1');
+    job.outputVideo.open(job.outputPath, fourcc, job.fps, region.frameSize, !args.gray);
+    if (!job.outputVideo.isOpened()) {
+        std::cerr << "Error: Could not create the output video file " << job.outputPath << std::endl;
+        std::exit(EXIT_FAILURE);
+    }
+}
+
+
+void admitStreams(streamScheduler& scheduler) {
+    // Called with scheduler.mutex held. Streams start in order, so a large one isn't passed over forever by the
+    // smaller ones behind it
+    while (!scheduler.waiting.empty()) {
+        streamJob& job = *scheduler.waiting.front();
+        if (scheduler.budgetBytes > 0 && scheduler.usedBytes + job.memoryBytes > scheduler.budgetBytes) break;
+        scheduler.waiting.pop_front();
+        scheduler.usedBytes += job.memoryBytes;
+        startStream(scheduler, job);
+    }
+}
+
+
+void startStream(streamScheduler& scheduler, streamJob& job) {
+    try {
+        job.extractor.reset(new MotionExtractor(job.videoSize, job.fps, job.offsetFrames, job.settings));
+    } catch (const std::exception& e) {
+        std::cerr << "Error: " << job.inputPath << ": " << e.what() << std::endl;
+        job.failed = true;
+        scheduler.usedBytes -= job.memoryBytes;
+        job.inputVideo.release();
+        job.outputVideo.release();
+        job.status.store(STREAM_FAILED, std::memory_order_relaxed);
+        return;
+    }
+    size_t capacity = job.extractor->bufferCapacity();
+    job.bufferCapacity.store(capacity, std::memory_order_relaxed);
+    job.status.store(STREAM_RUNNING, std::memory_order_relaxed);
+    if (metricsEnabled) addToGauge(threadMetrics().queueCapacity, capacity);
+    // Called from a worker for the motion frames of its own stream, so nothing else writes to the file meanwhile
+    job.extractor->setCallback([&job](const cv::Mat& frame, unsigned long frameIndex) {
+        {
+            traceScope scope("encode", frameIndex);
+            job.outputVideo.write(frame);
+        }
+        if (metricsEnabled) {
+            metricsShard& metrics = threadMetrics();
+            addToCounter(metrics.framesWritten, 1);
+            recordFrameLatency(metrics, traceNowNs() - job.frameStartNs);
+        }
+    });
+    job.extractor->setSceneCutCallback([&job](unsigned long frameIndex, double seconds) {
+        std::cerr << "Scene cut in " << job.inputPath << " at frame " << frameIndex << " (" << seconds << " s)" << std::endl;
+    });
+    scheduler.pool->submit([&scheduler, &job] { stepStream(scheduler, job); });
+}
+
+
+void stepStream(streamScheduler& scheduler, streamJob& job) {
+    // Decode and process one frame. The next frame is queued behind the streams already waiting on this worker
+    job.frameStartNs = metricsEnabled ? traceNowNs() : 0;
+    bool wanted = job.extractor->wants();
+    bool decoded;
+    {
+        traceScope scope("decode", job.frameIndex);
+        decoded = wanted ? job.inputVideo.read(job.decodedFrame) : job.inputVideo.grab();
+    }
+    if (!decoded) {
+        finishStream(scheduler, job);
+        return;
+    }
+    ++job.frameIndex;
+    job.framesDecoded.store(job.frameIndex, std::memory_order_relaxed);
+    if (metricsEnabled) addToCounter(threadMetrics().framesDecoded, 1);
+
+    try {
+        if (wanted) job.extractor->push(job.decodedFrame);
+        else job.extractor->skip();
+    } catch (const std::exception& e) {
+        std::cerr << "Error: " << job.inputPath << ": " << e.what() << std::endl;
+        job.failed = true;
+        finishStream(scheduler, job);
+        return;
+    }
+
+    // The queue gauges are kept as changes, since the next frame may run on another worker with another shard
+    long long depth = job.extractor->buffered();
+    job.bufferSize.store(depth, std::memory_order_relaxed);
+    if (metricsEnabled) addToGauge(threadMetrics().queueDepth, depth - job.reportedDepth);
+    job.reportedDepth = depth;
+    scheduler.pool->submit([&scheduler, &job] { stepStream(scheduler, job); });
+}
+
+
+void finishStream(streamScheduler& scheduler, streamJob& job) {
+    // The stream's buffers are freed before its share of the budget goes to a waiting stream. A stream that failed
+    // leaves its sidecars unfinished
+    if (!job.failed) {
+        try {
+            job.extractor->finish();
+        } catch (const std::exception& e) {
+            std::cerr << "Error: " << job.inputPath << ": " << e.what() << std::endl;
+            job.failed = true;
+        }
+    }
+    if (metricsEnabled) {
+        metricsShard& metrics = threadMetrics();
+        addToGauge(metrics.queueDepth, -job.reportedDepth);
+        addToGauge(metrics.queueCapacity, -static_cast<long long>(job.bufferCapacity.load(std::memory_order_relaxed)));
+    }
+    job.extractor.reset();
+    job.decodedFrame.release();
+    job.inputVideo.release();
+    job.outputVideo.release();
+    job.bufferSize.store(0, std::memory_order_relaxed);
+    job.status.store(job.failed ? STREAM_FAILED : STREAM_DONE, std::memory_order_relaxed);
+
+    std::lock_guard<std::mutex> lock(scheduler.mutex);
+    scheduler.usedBytes -= job.memoryBytes;
+    admitStreams(scheduler);
+}
+
+
+void reportStreams(const std::vector<std::unique_ptr<streamJob>>& jobs) {
+    // The SIGUSR1 report of --multi: one line per stream. The counts are read while the workers update them, so the
+    // lines of different streams may be a frame apart
+    progressRequested = 0;
+    std::ostringstream report;
+    report << std::fixed;
+    report.precision(1);
+    for (const auto& job : jobs) {
+        unsigned long framesDecoded = job->framesDecoded.load(std::memory_order_relaxed);
+        report << "Progress: " << job->inputPath << ": " << framesDecoded << "/" << static_cast<long>(job->totalFrames) \
+        << " frames";
+        if (job->totalFrames > 0) report << " (" << 100.0 * framesDecoded / job->totalFrames << "%)";
+        report << " | buffer " << job->bufferSize.load(std::memory_order_relaxed) << "/" \
+        << job->bufferCapacity.load(std::memory_order_relaxed) \
+        << " | " << streamStatusNames[job->status.load(std::memory_order_relaxed)] << "\n";
+    }
+
+    // One write() so the report isn't split by other output
+    const std::string text = report.str();
+    ssize_t written = write(STDERR_FILENO, text.data(), text.size());
+    (void)written;
+}
@@ -0,0 +1,152 @@
+// Motion-mask streams written by MotionExtraction --mask-stream, and a small reader for them.
+// The reader only needs POSIX. It maps the file and decodes single frames on request, so any frame can be read
+// without touching the ones before it.
+//
+// Layout, all fields little-endian:
+//   header:  "MMSK", uint32 version, uint32 width, uint32 height, float fps
+//   frames:  uint32 source frame index, uint32 payload size, payload
+//   index:   uint64 file offset of each frame record, in order
+//   trailer: uint64 file offset of the index, uint32 frame count, "MIDX"
+//
+// A payload holds the rows of one frame's mask, top to bottom. Each row is a list of run lengths as LEB128 varints.
+// Runs alternate between unset and set pixels, start with unset (which may be empty) and add up to the width.
+
+#ifndef MASK_STREAM_H
+#define MASK_STREAM_H
+
+#include <string>                   // Stream paths
+#include <cstdint>                  // Fixed-width fields
+#include <cstring>                  // std::memcmp(), std::memcpy(), std::memset()
+#include <fcntl.h>                  // open()
+#include <unistd.h>                 // close()
+#include <sys/mman.h>               // mmap()
+#include <sys/stat.h>               // fstat() for the file size
+
+const char maskStreamMagic[4] = {'M', 'M', 'S', 'K'};
+const char maskStreamIndexMagic[4] = {'M', 'I', 'D', 'X'};
+const uint32_t maskStreamVersion = 1;
+const size_t maskStreamHeaderSize = 20;
+const size_t maskStreamTrailerSize = 16;
+
+class maskStreamReader {
+public:
+    maskStreamReader() = default;
+    maskStreamReader(const maskStreamReader&) = delete;
+    maskStreamReader& operator=(const maskStreamReader&) = delete;
+    ~maskStreamReader() { close(); }
+
+    bool open(const std::string& path) {
+        // Returns false if the file can't be mapped or isn't a complete stream, for example one whose writer was killed
+        close();
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) return false;
+        struct stat info;
+        if (fstat(fd, &info) == 0 && info.st_size >= static_cast<off_t>(maskStreamHeaderSize + maskStreamTrailerSize)) {
+            size = static_cast<size_t>(info.st_size);
+            void* mapped = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (mapped != MAP_FAILED) data = static_cast<const unsigned char*>(mapped);
+        }
+        ::close(fd);
+        if (data == nullptr || !parse()) {
+            close();
+            return false;
+        }
+        return true;
+    }
+
+    void close() {
+        if (data != nullptr) munmap(const_cast<unsigned char*>(data), size);
+        data = nullptr;
+        size = 0;
+        frameCount = 0;
+    }
+
+    uint32_t width() const { return frameWidth; }
+    uint32_t height() const { return frameHeight; }
+    float fps() const { return frameRate; }
+    size_t frames() const { return frameCount; }
+
+    uint32_t sourceFrame(size_t frame) const {
+        // Index of the input video frame the mask was measured on
+        return read32(data + recordOffset(frame));
+    }
+
+    bool readFrame(size_t frame, unsigned char* mask) const {
+        // Decode one frame into width * height bytes, 255 where there is motion and 0 elsewhere.
+        // Returns false if the frame is out of range or its payload is damaged
+        if (frame >= frameCount) return false;
+        size_t offset = recordOffset(frame);
+        if (offset + 8 > size) return false;
+        const unsigned char* in = data + offset + 8;
+        const unsigned char* end = in + read32(data + offset + 4);
+        if (end > data + size) return false;
+
+        for (uint32_t y = 0; y < frameHeight; ++y) {
+            unsigned char* row = mask + static_cast<size_t>(y) * frameWidth;
+            uint32_t x = 0;
+            bool set = false;
+            while (x < frameWidth) {
+                uint64_t run = 0;
+                if (!readVarint(in, end, run) || run > frameWidth - x) return false;
+                std::memset(row + x, set ? 255 : 0, run);
+                x += static_cast<uint32_t>(run);
+                set = !set;
+            }
+        }
+        return in == end;
+    }
+
+private:
+    const unsigned char* data = nullptr;
+    size_t size = 0;
+    uint32_t frameWidth = 0;
+    uint32_t frameHeight = 0;
+    float frameRate = 0;
+    size_t frameCount = 0;
+    const unsigned char* index = nullptr;
+
+    static uint32_t read32(const unsigned char* p) {
+        return p[0] | p[1] << 8 | p[2] << 16 | static_cast<uint32_t>(p[3]) << 24;
+    }
+
+    static uint64_t read64(const unsigned char* p) {
+        return read32(p) | static_cast<uint64_t>(read32(p + 4)) << 32;
+    }
+
+    static bool readVarint(const unsigned char*& in, const unsigned char* end, uint64_t& value) {
+        for (int shift = 0; in < end && shift < 64; shift += 7) {
+            unsigned char byte = *in++;
+            value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+            if ((byte & 0x80) == 0) return true;
+        }
+        return false;
+    }
+
+    size_t recordOffset(size_t frame) const {
+        return static_cast<size_t>(read64(index + frame * 8));
+    }
+
+    bool parse() {
+        if (std::memcmp(data, maskStreamMagic, 4) != 0 || read32(data + 4) != maskStreamVersion) return false;
+        frameWidth = read32(data + 8);
+        frameHeight = read32(data + 12);
+        if (frameWidth == 0 || frameHeight == 0) return false;
+        uint32_t rate = read32(data + 16);
+        std::memcpy(&frameRate, &rate, sizeof(frameRate));
+
+        const unsigned char* trailer = data + size - maskStreamTrailerSize;
+        if (std::memcmp(trailer + 12, maskStreamIndexMagic, 4) != 0) return false;
+        uint64_t indexOffset = read64(trailer);
+        frameCount = read32(trailer + 8);
+        if (indexOffset < maskStreamHeaderSize || indexOffset + frameCount * 8ULL > size - maskStreamTrailerSize) {
+            return false;
+        }
+        index = data + indexOffset;
+        for (size_t frame = 0; frame < frameCount; ++frame) {
+            if (recordOffset(frame) + 8 > indexOffset) return false;
+        }
+        return true;
+    }
+};
+
+#endif
@@ -0,0 +1,84 @@
+/* C interface to libmotion, for runtimes that can't use the C++ API in motion_extractor.h.
+ * Frames are passed as caller-owned pixel buffers with a row stride in bytes. Input frames are read where they are.
+ * Output frames are copied once, from the buffer the extractor wrote them to into memory the caller provides, or
+ * handed to a callback without a copy.
+ *
+ * Input frames are 8-bit BGR, 3 bytes per pixel. Output frames are 8-bit BGR, or 8-bit gray with motion_options.gray.
+ * motion_output_format() tells which, and how big they are.
+ *
+ * Functions that return int return a negative value on failure and print the reason to stderr. An extractor must
+ * only be used by one thread at a time. */
+
+#ifndef MOTION_H
+#define MOTION_H
+
+#include <stddef.h>                 /* size_t */
+
+/* libmotion_c.so is built with hidden visibility, so only the functions marked with this are exported */
+#if defined(__GNUC__)
+#define MOTION_EXPORT __attribute__((visibility("default")))
+#else
+#define MOTION_EXPORT
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct motion_extractor motion_extractor;
+
+/* How an extractor processes frames, the C side of MotionExtractor::options. Fill it in with motion_options_init(),
+ * which sets the command line's defaults, and then change what differs. New options are only ever added at the end,
+ * and struct_size tells the library which of them the caller's motion.h had: options past it keep their defaults */
+typedef struct motion_options {
+    size_t struct_size;             /* sizeof(motion_options), set by motion_options_init() */
+    int overlay;                    /* Show the motion over the frame instead of on neutral gray */
+    int gray;                       /* Compare luma only and output one channel */
+    int threshold;                  /* Motion luma above which a pixel is part of the overlay mask, 0 to 254 */
+    int blur_radius;                /* Box blur radius of the overlay mask, 0 to 63 */
+    int dead_zone;                  /* Snap motion within this distance of neutral to neutral, 0 disables it */
+    int dead_zone_hold;             /* Distance that snaps a pixel that moved in the previous frame, -1 disables it */
+    unsigned long step;             /* Only every step-th frame is compared and output */
+    double adaptive_sigmas;         /* Raise the threshold this many noise sigmas above the floor, -1 disables it */
+    double sparse_threshold;        /* Only process tiles whose sampled difference exceeds this, -1 disables it */
+    int roi_x, roi_y;               /* Only process this rectangle. A width or height of 0 is the whole frame */
+    int roi_width, roi_height;
+    double scene_cut_threshold;     /* Mean difference that can start a scene cut, -1 disables detection */
+    int scene_cut_skip;             /* Output nothing until the buffer refills after a cut, instead of neutral frames */
+} motion_options;
+
+/* Receives each motion frame as soon as it is ready. The pixels are only valid during the call */
+typedef void (*motion_frame_callback)(void* user, const unsigned char* pixels, size_t stride, unsigned long frame_index);
+/* Receives the source frame index and time in seconds of each scene cut */
+typedef void (*motion_scene_cut_callback)(void* user, unsigned long frame_index, double seconds);
+
+MOTION_EXPORT void motion_options_init(motion_options* options);
+
+/* Frames are width x height. offset_frames is the distance between compared frames and may be fractional.
+ * options may be NULL for the defaults. Returns NULL on failure, including options out of range and options whose
+ * struct_size is larger than this library's, which come from a newer motion.h */
+MOTION_EXPORT motion_extractor* motion_create(int width, int height, double fps, double offset_frames, const motion_options* options);
+MOTION_EXPORT void motion_destroy(motion_extractor* extractor);
+
+/* 1 if the next frame is used. If not, it can be passed to motion_push_frame() as NULL without decoding it */
+MOTION_EXPORT int motion_wants_frame(const motion_extractor* extractor);
+/* Process the next frame. pixels may be NULL for a frame motion_wants_frame() said isn't used */
+MOTION_EXPORT int motion_push_frame(motion_extractor* extractor, const unsigned char* pixels, size_t stride);
+/* Call after the last frame */
+MOTION_EXPORT int motion_finish(motion_extractor* extractor);
+
+/* Copy the oldest motion frame that is ready into pixels. It is the only copy of the frame. frame_index may be NULL.
+ * Returns 1 if a frame was written, 0 if none is ready */
+MOTION_EXPORT int motion_get_frame(motion_extractor* extractor, unsigned char* pixels, size_t stride, unsigned long* frame_index);
+/* With a callback set, motion frames go to it directly and motion_get_frame() never returns any. NULL removes it */
+MOTION_EXPORT void motion_set_callback(motion_extractor* extractor, motion_frame_callback callback, void* user);
+/* Called for each cut motion_options.scene_cut_threshold detects. NULL removes it */
+MOTION_EXPORT void motion_set_scene_cut_callback(motion_extractor* extractor, motion_scene_cut_callback callback, void* user);
+
+MOTION_EXPORT void motion_output_format(const motion_extractor* extractor, int* width, int* height, int* channels);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,171 @@
+#include <cstring>                  // std::memcpy() of options from an older motion.h
+#include <exception>                // Nothing may cross the C boundary as an exception
+#include <iostream>                 // Error reports
+
+#include "motion.h"
+#include "motion_extractor.h"
+
+struct motion_extractor {
+    MotionExtractor extractor;
+    cv::Size frameSize;
+    cv::Mat pulled;                 // Buffer handed back to the extractor's pool by the next pull()
+
+    motion_extractor(int width, int height, double fps, double offsetFrames, const MotionExtractor::options& settings)
+        : extractor(cv::Size(width, height), fps, offsetFrames, settings), frameSize(width, height) {}
+};
+
+
+static int reportError(const char* function, const char* message) {
+    std::cerr << "Error: " << function << ": " << message << std::endl;
+    return -1;
+}
+
+
+void motion_options_init(motion_options* options) {
+    const MotionExtractor::options defaults;
+    options->struct_size = sizeof(motion_options);
+    options->overlay = defaults.overlay;
+    options->gray = defaults.gray;
+    options->threshold = defaults.threshold;
+    options->blur_radius = defaults.blurRadius;
+    options->dead_zone = defaults.deadZone;
+    options->dead_zone_hold = defaults.deadZoneHold;
+    options->step = defaults.step;
+    options->adaptive_sigmas = defaults.adaptiveSigmas;
+    options->sparse_threshold = defaults.sparseThreshold;
+    options->roi_x = options->roi_y = 0;
+    options->roi_width = options->roi_height = 0;
+    options->scene_cut_threshold = defaults.sceneCutThreshold;
+    options->scene_cut_skip = defaults.sceneCutSkip;
+}
+
+
+motion_extractor* motion_create(int width, int height, double fps, double offset_frames, const motion_options* options) {
+    if (width <= 0 || height <= 0 || !(offset_frames >= 0)) {
+        reportError("motion_create", "Invalid frame size or offset");
+        return nullptr;
+    }
+    // Options from an older motion.h end early, and the fields they don't have keep their defaults
+    motion_options given;
+    motion_options_init(&given);
+    if (options != nullptr) {
+        if (options->struct_size < sizeof(options->struct_size) || options->struct_size > sizeof(motion_options)) {
+            reportError("motion_create", "Options weren't set up by motion_options_init() or are from a newer motion.h");
+            return nullptr;
+        }
+        std::memcpy(&given, options, options->struct_size);
+        options = &given;
+    }
+    try {
+        // The extractor checks the ranges and throws std::invalid_argument, which is reported below
+        MotionExtractor::options settings;
+        if (options != nullptr) {
+            settings.overlay = options->overlay != 0;
+            settings.gray = options->gray != 0;
+            settings.threshold = options->threshold;
+            settings.blurRadius = options->blur_radius;
+            settings.deadZone = options->dead_zone;
+            settings.deadZoneHold = options->dead_zone_hold;
+            settings.step = options->step;
+            settings.adaptiveSigmas = options->adaptive_sigmas;
+            settings.sparseThreshold = options->sparse_threshold;
+            settings.sceneCutThreshold = options->scene_cut_threshold;
+            settings.sceneCutSkip = options->scene_cut_skip != 0;
+            if (options->roi_width > 0 && options->roi_height > 0) {
+                settings.rois.push_back(cv::Rect(options->roi_x, options->roi_y, options->roi_width, options->roi_height));
+            }
+        }
+        return new motion_extractor(width, height, fps, offset_frames, settings);
+    } catch (const std::exception& e) {
+        reportError("motion_create", e.what());
+        return nullptr;
+    }
+}
+
+
+void motion_destroy(motion_extractor* extractor) {
+    delete extractor;
+}
+
+
+int motion_wants_frame(const motion_extractor* extractor) {
+    return extractor->extractor.wants() ? 1 : 0;
+}
+
+
+int motion_push_frame(motion_extractor* extractor, const unsigned char* pixels, size_t stride) {
+    if (pixels == nullptr) {
+        extractor->extractor.skip();
+        return 0;
+    }
+    if (stride < static_cast<size_t>(extractor->frameSize.width) * 3) {
+        return reportError("motion_push_frame", "Stride is shorter than a row");
+    }
+    try {
+        // A header over the caller's pixels. The extractor only reads them, and copies what it needs to keep
+        cv::Mat frame(extractor->frameSize, CV_8UC3, const_cast<unsigned char*>(pixels), stride);
+        extractor->extractor.push(frame);
+    } catch (const std::exception& e) {
+        return reportError("motion_push_frame", e.what());
+    }
+    return 0;
+}
+
+
+int motion_finish(motion_extractor* extractor) {
+    try {
+        extractor->extractor.finish();
+    } catch (const std::exception& e) {
+        return reportError("motion_finish", e.what());
+    }
+    return 0;
+}
+
+
+int motion_get_frame(motion_extractor* extractor, unsigned char* pixels, size_t stride, unsigned long* frame_index) {
+    cv::Size size = extractor->extractor.outputSize();
+    int channels = extractor->extractor.settings().gray ? 1 : 3;
+    if (stride < static_cast<size_t>(size.width) * channels) {
+        return reportError("motion_get_frame", "Stride is shorter than a row");
+    }
+    try {
+        // pull() hands over the extractor's own output frame, so this copy is the only one
+        if (!extractor->extractor.pull(extractor->pulled, frame_index)) return 0;
+        // Same size and type, so copyTo() writes into the caller's memory instead of allocating
+        cv::Mat output(size, CV_MAKETYPE(CV_8U, channels), pixels, stride);
+        extractor->pulled.copyTo(output);
+    } catch (const std::exception& e) {
+        return reportError("motion_get_frame", e.what());
+    }
+    return 1;
+}
+
+
+void motion_set_callback(motion_extractor* extractor, motion_frame_callback callback, void* user) {
+    if (callback == nullptr) {
+        extractor->extractor.setCallback(MotionExtractor::callback());
+        return;
+    }
+    extractor->extractor.setCallback([callback, user](const cv::Mat& frame, unsigned long frameIndex) {
+        callback(user, frame.data, frame.step[0], frameIndex);
+    });
+}
+
+
+void motion_set_scene_cut_callback(motion_extractor* extractor, motion_scene_cut_callback callback, void* user) {
+    if (callback == nullptr) {
+        extractor->extractor.setSceneCutCallback(MotionExtractor::sceneCutCallback());
+        return;
+    }
+    extractor->extractor.setSceneCutCallback([callback, user](unsigned long frameIndex, double seconds) {
+        callback(user, frameIndex, seconds);
+    });
+}
+
+
+void motion_output_format(const motion_extractor* extractor, int* width, int* height, int* channels) {
+    cv::Size size = extractor->extractor.outputSize();
+    if (width != nullptr) *width = size.width;
+    if (height != nullptr) *height = size.height;
+    if (channels != nullptr) *channels = extractor->extractor.settings().gray ? 1 : 3;
+}
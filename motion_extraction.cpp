@@ -1,258 +1,1614 @@
-#include <queue>                    // Used for the frame buffer
-#include <string>                   // Standard string operations             
-#include <cstdlib>                  // std::exit()
+#include <map>                      // Delay buffer bytes by storage type
+#include <algorithm>                // std::min(), std::max(), std::fill()
+#include <mutex>                    // Guards registration of per-thread trace buffers and metrics shards
+#include <atomic>                   // Lock-free metrics counters
+#include <thread>                   // Metrics exporter thread
+#include <chrono>                   // Timestamps for trace events
+#include <memory>                   // std::unique_ptr
+#include <string>                   // Standard string operations
+#include <vector>                   // Per-thread trace event storage
+#include <csignal>                  // std::sig_atomic_t for the SIGUSR1 flag
+#include <cerrno>                   // errno from perf_event_open
+#include <cstdio>                   // std::rename() for atomic metrics file updates
+#include <cstdint>                  // Fixed-width fields in the binary motion statistics sidecar
+#include <cstdlib>                  // std::exit(), std::atexit()
+#include <cstring>                  // std::strerror()
+#include <stdexcept>                // Sidecars that can't be written and regions that are empty
+#include <iomanip>                  // Format the --stats table
+#include <fstream>                  // Write the trace file, read /proc/self/status and /proc/meminfo
+#include <sstream>                  // Build progress reports before writing them in one call
 #include <iostream>                 // Standard IO operations
-#include <getopt.h>                 // Parse arguments with getopt_long
-#include <unistd.h>                 // Parse arguments with getopt
+#include <fcntl.h>                  // O_CLOEXEC for the metrics socket
+#include <poll.h>                   // Wait for metrics scrapes with a timeout
+#include <unistd.h>                 // close(), read(), getpid()
+#include <netinet/in.h>             // Metrics HTTP endpoint
+#include <sys/ioctl.h>              // Enable and reset hardware counters
+#include <sys/socket.h>             // Metrics HTTP endpoint
+#include <sys/stat.h>               // Output file size for the --stats bitrate
+#include <sys/syscall.h>            // SYS_gettid for trace thread IDs, SYS_perf_event_open
+#include <linux/perf_event.h>       // Hardware performance counters for --stats
+
+#include "motion_extraction.h"
+#include "mask_stream.h"            // Motion-mask stream format for --mask-stream
 
 #include <opencv2/videoio.hpp>
 #include <opencv2/imgproc.hpp>
 #include <opencv2/imgcodecs.hpp>
-#include <opencv2/core/types.hpp>
-#include <opencv2/core/utility.hpp>
-
-unsigned char gammaLUT[256];        // Lookup table to quickly apply gamma correction to frames
-
-struct arguments {                  // parseArgs() returns this struct
-    std::string inputPath;
-    std::string outputPath;
-    int framesToSkip = 0;
-    int secondsToSkip = 0;
-    bool framesOption = false;
-    bool secondsOption = false;
-    bool overlay = false;
-};
-
-arguments parseArgs(int argc, char* argv[]);
-void createGammaLUT(unsigned char lut[256], float gamma_);
-void applyGammaCorrection(cv::Mat& image);
-void compareFrames(const cv::Mat& src1, const cv::Mat& src2, cv::Mat& dst);
-void extractMotion(cv::VideoCapture& inputVideo, cv::VideoWriter& outputVideo, unsigned long frameDelay, bool overlay);
-
-int main(int argc, char* argv[]) {
-    createGammaLUT(gammaLUT, 1/1.1);    // Fill the lookup table with precomputed gamma values
-
-    unsigned long frameDelay;
-
-    arguments args = parseArgs(argc, argv);
-
-    cv::VideoCapture inputVideo(args.inputPath);
-
-    if (!inputVideo.isOpened()) {
-        std::cerr << "Error: Could not open file " << args.outputPath << std::endl;
-        std::exit(EXIT_FAILURE);
-    }
-
-    // Stats about the input video for creating the output video stream
-    int videoWidth = static_cast<int>(inputVideo.get(cv::CAP_PROP_FRAME_WIDTH));
-    int videoHeight = static_cast<int>(inputVideo.get(cv::CAP_PROP_FRAME_HEIGHT));
-    double fps = inputVideo.get(cv::CAP_PROP_FPS);
-    double frameCount = inputVideo.get(cv::CAP_PROP_FRAME_COUNT);
-    int fourcc = cv::VideoWriter::fourcc('a', 'v', 'c', '1');
-
-    // Ensure that the frame delay from the command line args is less than the length of the video
-    if (args.framesOption) {
-        frameDelay = args.framesToSkip;
-        if (frameDelay > frameCount) {
-            std::cerr << "Error: Input video only has " << static_cast<int>(frameCount) << " frame(s). Cannot offset by " \
-            << frameDelay << " frame(s)." << std::endl;
-            std::exit(EXIT_FAILURE);
+
+unsigned char gammaLUT[256];
+bool tracingEnabled = false;
+std::mutex traceRegistryMutex;      // Only taken when a thread records its first event and when flushing
+std::vector<std::unique_ptr<traceBuffer>> traceRegistry;
+std::ofstream traceFile;            // Guarded by traceRegistryMutex
+bool traceFileEmpty = true;         // No event has been written yet, so the next one needs no separator
+thread_local traceBuffer* localTraceBuffer = nullptr;
+double progressInterval = 0;
+int progressFD = -1;
+volatile std::sig_atomic_t progressRequested = 0;   // Set by the SIGUSR1 handler, cleared after reporting
+bool metricsEnabled = false;
+std::string metricsPath;
+double metricsInterval = 10;
+int metricsListenFD = -1;
+std::atomic<bool> metricsStop{false};
+std::thread metricsThread;
+std::mutex metricsRegistryMutex;    // Only taken when a thread registers its shard and when exporting
+std::vector<std::unique_ptr<metricsShard>> metricsRegistry;
+thread_local metricsShard* localMetricsShard = nullptr;
+int perfGroupFD = -1;               // Leader of the counter group. -1 when counters are unavailable
+countingAllocator& matAllocator = *new countingAllocator;
+
+
+void createGammaLUT(unsigned char lut[256], float gamma_) {
+    // Calculate every possible gamma value from 0 to 255 to speed up calculations later
+    for (int i = 0; i < 256; ++i) {
+        lut[i] = cv::saturate_cast<unsigned char>(cv::pow(i / 255.0, gamma_) * 255.0);
+    }
+}
+
+
+void applyGammaCorrection(cv::Mat& image) {
+    // Apply gamma correction using the lookup table
+    // Each channel gets gamma correction applied, so the same loop covers BGR and --gray frames
+    const int values = image.cols * image.channels();
+    for (int y = 0; y < image.rows; ++y) {
+        unsigned char* p = image.ptr<unsigned char>(y);
+        for (int i = 0; i < values; ++i) p[i] = gammaLUT[p[i]];
+    }
+}
+
+
+inline unsigned char blendInverted(int a, int b) {
+    // Same result as addWeighted(a, 0.5, 255 - b, 0.5): half of a + 255 - b, rounded half to even
+    int sum = a + 255 - b;
+    int half = sum >> 1;
+    return static_cast<unsigned char>(half + (sum & half & 1));
+}
+
+
+inline int bgrLuma(const unsigned char* bgr) {
+    // Same fixed-point BGR to gray weights as cvtColor, so the statistics, the overlay mask and --gray agree
+    return (bgr[0] * 1868 + bgr[1] * 9617 + bgr[2] * 4899 + (1 << 13)) >> 14;
+}
+
+
+inline bool snapToNeutral(unsigned char* d, unsigned char* live, int zone, int hold) {
+    // --dead-zone: a pixel whose channels all stay within zone of neutral becomes exactly neutral, so noise in
+    // static areas doesn't cost the encoder anything. With hysteresis, a pixel that moved in the previous frame
+    // only snaps back once it is within hold
+    int deviation = std::max(std::abs(d[0] - 128), std::max(std::abs(d[1] - 128), std::abs(d[2] - 128)));
+    bool snap = deviation <= (live != nullptr && *live != 0 ? hold : zone);
+    if (snap) d[0] = d[1] = d[2] = 128;
+    if (live != nullptr) *live = !snap;
+    return snap;
+}
+
+
+inline void accumulateMotion(short& sum, unsigned char value, timelapseMode mode) {
+    // --timelapse keeps motion relative to the neutral 128, so pixels that are never compared add nothing
+    int motion = value - 128;
+    if (mode == TIMELAPSE_MEAN) {
+        sum = static_cast<short>(sum + motion);
+    } else if (std::abs(motion) > std::abs(sum)) {
+        sum = static_cast<short>(motion);
+    }
+}
+
+
+inline int gridCell(int position, int size) {
+    // Grid cell row or column that holds position, with the same cell boundaries as countCellPixels(): cell c starts
+    // at c * size / motionGridSize. position * motionGridSize / size can land one cell early when size isn't a multiple
+    int cell = position * motionGridSize / size;
+    while (cell > 0 && cell * size / motionGridSize > position) --cell;
+    while ((cell + 1) * size / motionGridSize <= position) ++cell;
+    return cell;
+}
+
+
+unsigned long compareRegion(const cv::Mat& src1, const cv::Mat& src2, cv::Mat& dst, const cv::Rect& region,
+                            const MotionExtractor::options& settings, motionAccumulator* acc, cv::Mat* timelapse,
+                            const cv::Mat* older, int fraction, cv::Mat* live) {
+    // Combine the first frame with a negative of the second frame in a single pass over both frames, gathering the
+    // motion statistics in the same pass when acc is given. Only touches the pixels inside region, so sparse
+    // processing can call it per tile.
+    // dst must already have the size and type of the frames. With timelapse (CV_16SC3, the size of the frames) each
+    // motion value is also added to the --timelapse window. live (CV_8UC1) holds the --dead-zone hysteresis state.
+    // Returns the number of pixels --dead-zone snapped to neutral
+    if (src1.channels() == 1) {
+        return compareGrayRegion(src1, src2, dst, region, settings, acc, timelapse, older, fraction, live);
+    }
+    const int deadZone = settings.deadZone;
+    const int deadZoneHold = settings.deadZoneHold;
+    const timelapseMode mode = settings.timelapseAccumulation;
+    const int x0 = region.x;
+    const int x1 = region.x + region.width;
+    // A fractional offset compares with src2 mixed with the older frame by fraction / 256. The mix is made one row
+    // at a time, so it stays in cache and no mixed frame is ever stored
+    thread_local std::vector<unsigned char> mixedRow;
+    if (older != nullptr && mixedRow.size() < static_cast<size_t>(src2.cols) * 3) mixedRow.resize(src2.cols * 3);
+    const int newerWeight = 256 - fraction;
+    unsigned long snapped = 0;
+
+    for (int y = region.y; y < region.y + region.height; ++y) {
+        const unsigned char* a = src1.ptr<unsigned char>(y);
+        const unsigned char* b = src2.ptr<unsigned char>(y);
+        unsigned char* d = dst.ptr<unsigned char>(y);
+        if (older != nullptr) {
+            const unsigned char* o = older->ptr<unsigned char>(y);
+            unsigned char* mixed = mixedRow.data();
+            for (int i = x0 * 3; i < x1 * 3; ++i) {
+                mixed[i] = static_cast<unsigned char>((b[i] * newerWeight + o[i] * fraction + 128) >> 8);
+            }
+            b = mixed;
+        }
+        short* t = timelapse != nullptr ? timelapse->ptr<short>(y) : nullptr;
+        unsigned char* l = live != nullptr ? live->ptr<unsigned char>(y) : nullptr;
+
+        if (acc == nullptr && t == nullptr && deadZone == 0) {
+            for (int i = x0 * 3; i < x1 * 3; ++i) d[i] = blendInverted(a[i], b[i]);
+            continue;
+        }
+
+        if (acc == nullptr) {
+            for (int i = x0 * 3; i < x1 * 3; i += 3) {
+                d[i] = blendInverted(a[i], b[i]);
+                d[i + 1] = blendInverted(a[i + 1], b[i + 1]);
+                d[i + 2] = blendInverted(a[i + 2], b[i + 2]);
+                if (deadZone > 0) snapped += snapToNeutral(d + i, l != nullptr ? l + i / 3 : nullptr, deadZone, deadZoneHold);
+                if (t != nullptr) {
+                    accumulateMotion(t[i], d[i], mode);
+                    accumulateMotion(t[i + 1], d[i + 1], mode);
+                    accumulateMotion(t[i + 2], d[i + 2], mode);
+                }
+            }
+            continue;
+        }
+
+        unsigned long long* rowCells = acc->cellSums + gridCell(y, src1.rows) * motionGridSize;
+        unsigned long activePixels = 0;
+        int* h = nullptr;
+        int hx = 0, shift = 0;
+        if (acc->heatmap != nullptr) {
+            shift = acc->heatmap->shift;
+            h = acc->heatmap->counts.ptr<int>((y + acc->heatmap->origin.y) >> shift);
+            hx = acc->heatmap->origin.x;
+        }
+        unsigned char* m = acc->mask != nullptr ? acc->mask->ptr<unsigned char>(y) : nullptr;
+        unsigned int* histogram = acc->histogram;
+        unsigned short* blocks = nullptr;
+        int blockShift = 0;
+        if (acc->blocks != nullptr) {
+            blockShift = acc->blocks->shift;
+            blocks = acc->blocks->counts.ptr<unsigned short>(y >> blockShift);
+        }
+
+        // Walk the grid cells the row crosses so each cell's sum is kept in a register
+        int cell = gridCell(x0, src1.cols);
+        for (int start = x0; start < x1; ++cell) {
+            int end = std::min(x1, (cell + 1) * src1.cols / motionGridSize);
+            unsigned int sum = 0;   // One row of one cell can't overflow this
+            for (int i = start * 3; i < end * 3; i += 3) {
+                d[i] = blendInverted(a[i], b[i]);
+                d[i + 1] = blendInverted(a[i + 1], b[i + 1]);
+                d[i + 2] = blendInverted(a[i + 2], b[i + 2]);
+                if (deadZone > 0) snapped += snapToNeutral(d + i, l != nullptr ? l + i / 3 : nullptr, deadZone, deadZoneHold);
+                sum += std::abs(a[i] - b[i]) + std::abs(a[i + 1] - b[i + 1]) + std::abs(a[i + 2] - b[i + 2]);
+                int luma = bgrLuma(d + i);
+                bool moving = luma > acc->threshold;
+                if (histogram != nullptr) ++histogram[luma];
+                activePixels += moving;
+                if (h != nullptr && moving) ++h[(i / 3 + hx) >> shift];
+                if (m != nullptr) m[i / 3] = moving ? 255 : 0;
+                if (blocks != nullptr && moving) ++blocks[(i / 3) >> blockShift];
+                if (t != nullptr) {
+                    accumulateMotion(t[i], d[i], mode);
+                    accumulateMotion(t[i + 1], d[i + 1], mode);
+                    accumulateMotion(t[i + 2], d[i + 2], mode);
+                }
+            }
+            rowCells[cell] += sum;
+            start = end;
         }
+        acc->activePixels += activePixels;
     }
+    return snapped;
+}
 
-    if (args.secondsOption) {
-        frameDelay = args.secondsToSkip * fps;
-        if (frameDelay > frameCount) {
-            std::cerr << "Error: Input video is only " << static_cast<int>(frameCount / fps) << " second(s) long. Cannot offset by " \
-            << args.secondsToSkip << " second(s)." << std::endl;
-            std::exit(EXIT_FAILURE);
+
+unsigned long compareGrayRegion(const cv::Mat& src1, const cv::Mat& src2, cv::Mat& dst, const cv::Rect& region,
+                                const MotionExtractor::options& settings, motionAccumulator* acc, cv::Mat* timelapse,
+                                const cv::Mat* older, int fraction, cv::Mat* live) {
+    // compareRegion() for --gray frames. The blended value is the luma itself, so there is one value per pixel to
+    // blend, threshold and accumulate
+    const int deadZone = settings.deadZone;
+    const int deadZoneHold = settings.deadZoneHold;
+    const int x0 = region.x;
+    const int x1 = region.x + region.width;
+    thread_local std::vector<unsigned char> mixedRow;
+    if (older != nullptr && mixedRow.size() < static_cast<size_t>(src2.cols)) mixedRow.resize(src2.cols);
+    const int newerWeight = 256 - fraction;
+    unsigned long snapped = 0;
+
+    for (int y = region.y; y < region.y + region.height; ++y) {
+        const unsigned char* a = src1.ptr<unsigned char>(y);
+        const unsigned char* b = src2.ptr<unsigned char>(y);
+        unsigned char* d = dst.ptr<unsigned char>(y);
+        if (older != nullptr) {
+            const unsigned char* o = older->ptr<unsigned char>(y);
+            unsigned char* mixed = mixedRow.data();
+            for (int x = x0; x < x1; ++x) {
+                mixed[x] = static_cast<unsigned char>((b[x] * newerWeight + o[x] * fraction + 128) >> 8);
+            }
+            b = mixed;
+        }
+        short* t = timelapse != nullptr ? timelapse->ptr<short>(y) : nullptr;
+        unsigned char* l = live != nullptr ? live->ptr<unsigned char>(y) : nullptr;
+
+        for (int x = x0; x < x1; ++x) d[x] = blendInverted(a[x], b[x]);
+        if (deadZone > 0) {
+            for (int x = x0; x < x1; ++x) {
+                bool snap = std::abs(d[x] - 128) <= (l != nullptr && l[x] != 0 ? deadZoneHold : deadZone);
+                if (snap) d[x] = 128;
+                if (l != nullptr) l[x] = !snap;
+                snapped += snap;
+            }
+        }
+        if (t != nullptr) {
+            for (int x = x0; x < x1; ++x) accumulateMotion(t[x], d[x], settings.timelapseAccumulation);
+        }
+        if (acc == nullptr) continue;
+
+        unsigned long long* rowCells = acc->cellSums + gridCell(y, src1.rows) * motionGridSize;
+        unsigned long activePixels = 0;
+        int* h = nullptr;
+        int hx = 0, shift = 0;
+        if (acc->heatmap != nullptr) {
+            shift = acc->heatmap->shift;
+            h = acc->heatmap->counts.ptr<int>((y + acc->heatmap->origin.y) >> shift);
+            hx = acc->heatmap->origin.x;
+        }
+        unsigned char* m = acc->mask != nullptr ? acc->mask->ptr<unsigned char>(y) : nullptr;
+        unsigned int* histogram = acc->histogram;
+        unsigned short* blocks = nullptr;
+        int blockShift = 0;
+        if (acc->blocks != nullptr) {
+            blockShift = acc->blocks->shift;
+            blocks = acc->blocks->counts.ptr<unsigned short>(y >> blockShift);
+        }
+
+        int cell = gridCell(x0, src1.cols);
+        for (int start = x0; start < x1; ++cell) {
+            int end = std::min(x1, (cell + 1) * src1.cols / motionGridSize);
+            unsigned int sum = 0;
+            for (int x = start; x < end; ++x) {
+                sum += std::abs(a[x] - b[x]);
+                bool moving = d[x] > acc->threshold;
+                if (histogram != nullptr) ++histogram[d[x]];
+                activePixels += moving;
+                if (h != nullptr && moving) ++h[(x + hx) >> shift];
+                if (m != nullptr) m[x] = moving ? 255 : 0;
+                if (blocks != nullptr && moving) ++blocks[x >> blockShift];
+            }
+            rowCells[cell] += sum;
+            start = end;
+        }
+        acc->activePixels += activePixels;
+    }
+    return snapped;
+}
+
+
+void finishTimelapse(cv::Mat& sums, cv::Mat& motion, int frames, timelapseMode mode) {
+    // Turn a --timelapse window back into a motion frame and clear the sums for the next window in the same pass.
+    // sums and motion are views of the same region
+    for (int y = 0; y < motion.rows; ++y) {
+        short* s = sums.ptr<short>(y);
+        unsigned char* d = motion.ptr<unsigned char>(y);
+        for (int i = 0; i < motion.cols * motion.channels(); ++i) {
+            int value = s[i];
+            if (mode == TIMELAPSE_MEAN) {
+                value = (value >= 0 ? value + frames / 2 : value - frames / 2) / frames;
+            }
+            d[i] = static_cast<unsigned char>(128 + value);
+            s[i] = 0;
+        }
+    }
+}
+
+
+void finishMotionStats(const motionAccumulator& acc, const unsigned long long cellPixels[], motionStats& stats) {
+    // Turn the sums into per-value means over the active pixels of each cell (from countCellPixels()).
+    // Active pixels that were never compared, like unchanged sparse tiles, count as no difference.
+    // A mean can't exceed 255, but the grid is clamped anyway so that --scene-cut never sees a wrapped value
+    unsigned long long total = 0, pixels = 0;
+    for (int cell = 0; cell < motionGridSize * motionGridSize; ++cell) {
+        unsigned long long values = cellPixels[cell] * acc.values;
+        stats.grid[cell] = static_cast<unsigned char>(values > 0 ? std::min(acc.cellSums[cell] / values, 255ULL) : 0);
+        total += acc.cellSums[cell];
+        pixels += cellPixels[cell];
+    }
+    stats.meanAbsDiff = pixels > 0 ? static_cast<double>(total) / (static_cast<double>(pixels) * acc.values) : 0;
+    stats.activePixels = acc.activePixels;
+}
+
+
+void thresholdMotion(const cv::Mat& motion, cv::Mat& mask, int threshold) {
+    // The overlay mask: 255 where the luma of the motion frame is above threshold, 0 elsewhere. mask is CV_8UC1 with
+    // the size of motion, and both may be views of a region of larger images. With --gray the motion is the luma
+    for (int y = 0; y < motion.rows; ++y) {
+        const unsigned char* d = motion.ptr<unsigned char>(y);
+        unsigned char* m = mask.ptr<unsigned char>(y);
+        if (motion.channels() == 1) {
+            for (int x = 0; x < motion.cols; ++x) m[x] = d[x] > threshold ? 255 : 0;
+        } else {
+            for (int x = 0; x < motion.cols; ++x) m[x] = bgrLuma(d + 3 * x) > threshold ? 255 : 0;
+        }
+    }
+}
+
+
+void overlayMotion(const cv::Mat& frame, cv::Mat& motion, const cv::Mat& mask) {
+    // Overlay the blurred mask on the frame by OR-ing it into every channel. All three may be views of the same
+    // region of larger images, so motion is only ever written in place
+    const int channels = motion.channels();
+    for (int y = 0; y < motion.rows; ++y) {
+        const unsigned char* f = frame.ptr<unsigned char>(y);
+        const unsigned char* m = mask.ptr<unsigned char>(y);
+        unsigned char* d = motion.ptr<unsigned char>(y);
+        if (channels == 1) {
+            for (int x = 0; x < motion.cols; ++x) d[x] = f[x] | m[x];
+        } else {
+            for (int x = 0; x < motion.cols; ++x) {
+                d[3 * x] = f[3 * x] | m[x];
+                d[3 * x + 1] = f[3 * x + 1] | m[x];
+                d[3 * x + 2] = f[3 * x + 2] | m[x];
+            }
+        }
+    }
+}
+
+
+void blurMask(cv::Mat& mask, int radius, blurWorkspace& workspace) {
+    // Box blur of a 0/255 mask in place, with the same result and border handling as cv::blur() (BORDER_REFLECT_101).
+    // Both passes slide a running count of set pixels along, so the cost doesn't grow with the radius. Rows of the
+    // horizontal pass and column strips of the vertical pass run in parallel. The workspace is only set up again when
+    // the size or radius changes, so nothing is allocated per frame
+    const int rows = mask.rows;
+    const int cols = mask.cols;
+    const int window = 2 * radius + 1;
+    const unsigned int area = window * window;
+
+    // Source index of every position the windows reach, including the reflected ones past the edges
+    std::vector<int>& xIndex = workspace.xIndex;
+    std::vector<int>& yIndex = workspace.yIndex;
+    if (workspace.size != mask.size() || workspace.radius != radius) {
+        xIndex.resize(cols + 2 * radius);
+        yIndex.resize(rows + 2 * radius);
+        for (int i = 0; i < cols + 2 * radius; ++i) xIndex[i] = cv::borderInterpolate(i - radius, cols, cv::BORDER_REFLECT_101);
+        for (int i = 0; i < rows + 2 * radius; ++i) yIndex[i] = cv::borderInterpolate(i - radius, rows, cv::BORDER_REFLECT_101);
+        workspace.sums.resize(cols);
+        workspace.size = mask.size();
+        workspace.radius = radius;
+    }
+
+    cv::Mat& counts = workspace.counts;
+    counts.create(rows, cols, CV_8UC1);
+    cv::parallel_for_(cv::Range(0, rows), [&](const cv::Range& range) {
+        for (int y = range.start; y < range.end; ++y) {
+            const unsigned char* in = mask.ptr<unsigned char>(y);
+            unsigned char* out = counts.ptr<unsigned char>(y);
+            int count = 0;
+            for (int i = 0; i < window - 1; ++i) count += in[xIndex[i]] != 0;
+            for (int x = 0; x < cols; ++x) {
+                count += in[xIndex[x + window - 1]] != 0;
+                out[x] = static_cast<unsigned char>(count);
+                count -= in[xIndex[x]] != 0;
+            }
+        }
+    });
+
+    const int strips = (cols + blurStripWidth - 1) / blurStripWidth;
+    cv::parallel_for_(cv::Range(0, strips), [&](const cv::Range& range) {
+        const int x0 = range.start * blurStripWidth;
+        const int x1 = std::min(cols, range.end * blurStripWidth);
+        // Each strip only uses its own columns of the shared sums
+        unsigned int* sums = workspace.sums.data() + x0;
+        std::fill(sums, sums + (x1 - x0), 0u);
+        for (int i = 0; i < window - 1; ++i) {
+            const unsigned char* in = counts.ptr<unsigned char>(yIndex[i]) + x0;
+            for (int x = 0; x < x1 - x0; ++x) sums[x] += in[x];
+        }
+        for (int y = 0; y < rows; ++y) {
+            const unsigned char* enter = counts.ptr<unsigned char>(yIndex[y + window - 1]) + x0;
+            const unsigned char* leave = counts.ptr<unsigned char>(yIndex[y]) + x0;
+            unsigned char* out = mask.ptr<unsigned char>(y) + x0;
+            for (int x = 0; x < x1 - x0; ++x) {
+                sums[x] += enter[x];
+                // 255 * sum / area rounded to nearest. The area is odd, so there are no ties to break
+                out[x] = static_cast<unsigned char>((510 * sums[x] + area) / (2 * area));
+                sums[x] -= leave[x];
+            }
+        }
+    });
+}
+
+
+void fillStaticRegion(const cv::Mat& frame, cv::Mat& motion, bool overlay) {
+    // What post-processing produces where nothing changed: identical pixels compare to 128 on every channel,
+    // which the overlay mask ignores and gamma correction maps to a constant
+    if (overlay) {
+        frame.copyTo(motion);
+    } else {
+        motion.setTo(cv::Scalar::all(gammaLUT[128]));
+    }
+}
+
+
+double findChangedRegions(const cv::Mat& src1, const cv::Mat& src2, double threshold, std::vector<cv::Rect>& changed,
+                          std::vector<cv::Rect>& unchanged) {
+    // Cheap first pass for sparse processing. Samples a 4x4 grid of pixels in each tile and flags the tile when their
+    // mean absolute difference exceeds threshold. Neighbouring tiles with the same flag in a tile row are merged
+    // into one rectangle. Returns the fraction of tiles that changed
+    const int offsets[4] = {2, 6, 10, 14};
+    const int channels = src1.channels();
+    unsigned long changedTiles = 0, tiles = 0;
+    changed.clear();
+    unchanged.clear();
+
+    for (int ty = 0; ty < src1.rows; ty += sparseTileSize) {
+        int tileHeight = std::min(sparseTileSize, src1.rows - ty);
+        int runStart = 0;
+        bool runChanged = false;
+
+        for (int tx = 0; tx < src1.cols; tx += sparseTileSize) {
+            int tileWidth = std::min(sparseTileSize, src1.cols - tx);
+            int sum = 0;
+            for (int sy : offsets) {
+                int y = ty + std::min(sy, tileHeight - 1);
+                const unsigned char* a = src1.ptr<unsigned char>(y);
+                const unsigned char* b = src2.ptr<unsigned char>(y);
+                for (int sx : offsets) {
+                    int i = (tx + std::min(sx, tileWidth - 1)) * channels;
+                    for (int c = 0; c < channels; ++c) sum += std::abs(a[i + c] - b[i + c]);
+                }
+            }
+            bool tileChanged = sum > threshold * 16 * channels;
+            changedTiles += tileChanged;
+            ++tiles;
+
+            // Close the current run when the flag flips
+            if (tx > 0 && tileChanged != runChanged) {
+                (runChanged ? changed : unchanged).push_back(cv::Rect(runStart, ty, tx - runStart, tileHeight));
+                runStart = tx;
+            }
+            runChanged = tileChanged;
+        }
+        (runChanged ? changed : unchanged).push_back(cv::Rect(runStart, ty, src1.cols - runStart, tileHeight));
+    }
+
+    return tiles > 0 ? static_cast<double>(changedTiles) / tiles : 0;
+}
+
+
+long long traceNowNs() {
+    // Nanoseconds since the first call, so trace timestamps start near zero
+    static const std::chrono::steady_clock::time_point epoch = std::chrono::steady_clock::now();
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - epoch).count();
+}
+
+
+traceScope::traceScope(const char* stage_, unsigned long frame_) : stage(stage_), frame(frame_), startNs(0) {
+    if (tracingEnabled) startNs = traceNowNs();
+}
+
+
+traceScope::~traceScope() {
+    if (!tracingEnabled) return;
+    long long endNs = traceNowNs();
+
+    // Each thread registers its own buffer once. After that, recording an event never takes a lock
+    if (localTraceBuffer == nullptr) {
+        std::unique_ptr<traceBuffer> buffer(new traceBuffer);
+        buffer->threadID = static_cast<long>(syscall(SYS_gettid));
+        buffer->events.reserve(traceChunkEvents);
+        localTraceBuffer = buffer.get();
+        std::lock_guard<std::mutex> lock(traceRegistryMutex);
+        traceRegistry.push_back(std::move(buffer));
+    }
+
+    std::vector<traceEvent>& events = localTraceBuffer->events;
+    events.push_back({stage, startNs, endNs - startNs, frame});
+    if (events.size() < traceChunkEvents) return;
+
+    // A full chunk goes to the file, so memory stays bounded on long runs and the vector never grows. The write
+    // itself shows up in the trace as a "trace" event
+    long long flushStartNs = traceNowNs();
+    {
+        std::lock_guard<std::mutex> lock(traceRegistryMutex);
+        writeTraceEvents(*localTraceBuffer);
+    }
+    events.clear();
+    events.push_back({"trace", flushStartNs, traceNowNs() - flushStartNs, frame});
+}
+
+
+bool startTrace(const std::string& path) {
+    // Opens the Chrome Trace Event Format JSON file. Events are appended in chunks while the program runs, and
+    // writeTrace() adds the rest and closes the file
+    traceFile.open(path);
+    if (!traceFile) return false;
+    traceFile << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+    traceFile << std::fixed;
+    traceFile.precision(3);
+    traceNowNs();                   // Start the trace clock before the first event
+    tracingEnabled = true;
+    return true;
+}
+
+
+void writeTraceEvents(const traceBuffer& buffer) {
+    // The caller holds traceRegistryMutex
+    long processID = static_cast<long>(getpid());
+    for (const traceEvent& event : buffer.events) {
+        if (!traceFileEmpty) traceFile << ",\n";
+        traceFileEmpty = false;
+        // Timestamps and durations are in microseconds
+        traceFile << "{\"name\":\"" << event.stage << "\",\"cat\":\"frame\",\"ph\":\"X\"" \
+        << ",\"ts\":" << event.startNs / 1000.0 << ",\"dur\":" << event.durationNs / 1000.0 \
+        << ",\"pid\":" << processID << ",\"tid\":" << buffer.threadID \
+        << ",\"args\":{\"frame\":" << event.frame << "}}";
+    }
+}
+
+
+void writeTrace() {
+    // Flush what every thread recorded since its last chunk and finish the file
+    std::lock_guard<std::mutex> lock(traceRegistryMutex);
+    for (const auto& buffer : traceRegistry) {
+        writeTraceEvents(*buffer);
+        buffer->events.clear();
+    }
+    traceFile << "\n]}\n";
+    traceFile.close();
+    if (!traceFile) std::cerr << "Error: Could not write the trace file" << std::endl;
+}
+
+
+void requestProgress(int) {
+    // Only async-signal-safe work here. The frame loop prints the report
+    progressRequested = 1;
+}
+
+
+long readProcKiB(const char* path, const char* field) {
+    // Read one "Field:   1234 kB" line from a /proc file such as /proc/self/status. Returns -1 if it is unavailable
+    std::ifstream status(path);
+    std::string line;
+    size_t fieldLength = std::char_traits<char>::length(field);
+    while (std::getline(status, line)) {
+        if (line.compare(0, fieldLength, field) == 0 && line.size() > fieldLength && line[fieldLength] == ':') {
+            return std::stol(line.substr(fieldLength + 1));
         }
     }
+    return -1;
+}
+
+
+void reportProgress(progressState& progress, bool force) {
+    // Called once per frame. Only does work when a report is due or was requested with SIGUSR1
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    double sinceLast = std::chrono::duration<double>(now - progress.lastReport).count();
+    bool due = progressInterval > 0 && sinceLast >= progressInterval;
+    if (!force && !due && !progressRequested) return;
+    progressRequested = 0;
+
+    double elapsed = std::chrono::duration<double>(now - progress.start).count();
+    double averageFPS = elapsed > 0 ? progress.framesDecoded / elapsed : 0;
+    double instantFPS = sinceLast > 0 ? (progress.framesDecoded - progress.framesAtLastReport) / sinceLast : 0;
+    double remaining = progress.totalFrames > progress.framesDecoded ? progress.totalFrames - progress.framesDecoded : 0;
+    double eta = averageFPS > 0 ? remaining / averageFPS : -1;
+    long rssKiB = readProcKiB("/proc/self/status", "VmRSS");
+    long pssKiB = readProcKiB("/proc/self/smaps_rollup", "Pss");
+    const memoryAccounting noMemory;
+    const memoryAccounting& memoryUsage = progress.memory != nullptr ? *progress.memory : noMemory;
+    unsigned long long allocations = matAllocator.allocations.load(std::memory_order_relaxed);
+    unsigned long framesSinceLast = progress.framesDecoded - progress.framesAtLastReport;
+    double allocationsPerFrame = framesSinceLast > 0 ? \
+    static_cast<double>(allocations - progress.allocationsAtLastReport) / framesSinceLast : 0;
+
+    progress.lastReport = now;
+    progress.allocationsAtLastReport = allocations;
+    progress.framesAtLastReport = progress.framesDecoded;
+
+    std::ostringstream report;
+    report << std::fixed;
+    report.precision(1);
+    if (progressFD >= 0) {
+        report << "{\"frames\":" << progress.framesDecoded << ",\"total_frames\":" << static_cast<long>(progress.totalFrames) \
+        << ",\"fps\":" << instantFPS << ",\"avg_fps\":" << averageFPS << ",\"eta_s\":" << eta \
+        << ",\"elapsed_s\":" << elapsed << ",\"buffer\":" << progress.bufferSize \
+        << ",\"buffer_capacity\":" << progress.bufferCapacity << ",\"rss_kib\":" << rssKiB << ",\"pss_kib\":" << pssKiB \
+        << ",\"buffer_bytes\":" << memoryUsage.bufferTotalBytes << ",\"workspace_bytes\":" << memoryUsage.workspaceBytes \
+        << ",\"allocs_per_frame\":" << allocationsPerFrame \
+        << ",\"done\":" << (force ? "true" : "false") << "}\n";
+    } else {
+        report << "Progress: " << progress.framesDecoded << "/" << static_cast<long>(progress.totalFrames) << " frames";
+        if (progress.totalFrames > 0) report << " (" << 100.0 * progress.framesDecoded / progress.totalFrames << "%)";
+        report << " | " << instantFPS << " fps (avg " << averageFPS << ")";
+        if (eta >= 0) report << " | ETA " << static_cast<long>(eta) << "s";
+        report << " | buffer " << progress.bufferSize << "/" << progress.bufferCapacity;
+        report << " (" << memoryUsage.bufferTotalBytes / (1 << 20) << " MiB) | workspace " << memoryUsage.workspaceBytes / (1 << 20) \
+        << " MiB | " << allocationsPerFrame << " allocs/frame";
+        if (rssKiB >= 0) report << " | RSS " << rssKiB / 1024 << " MiB";
+        if (pssKiB >= 0) report << " | PSS " << pssKiB / 1024 << " MiB";
+        report << "\n";
+    }
 
-    cv::VideoWriter outputVideo(args.outputPath, fourcc, fps, cv::Size(videoWidth, videoHeight));
-    
-    if (!outputVideo.isOpened()) {
-        std::cerr << "Error: Could not create the output video file " << args.outputPath << std::endl;
-        std::exit(EXIT_FAILURE);
+    // One write() per report so lines from concurrent writers to the same descriptor don't interleave
+    const std::string text = report.str();
+    ssize_t written = write(progressFD >= 0 ? progressFD : STDERR_FILENO, text.data(), text.size());
+    (void)written;
+}
+
+
+metricsShard& threadMetrics() {
+    // Each frame loop thread registers one shard. Updating it afterwards never takes a lock
+    if (localMetricsShard == nullptr) {
+        std::unique_ptr<metricsShard> shard(new metricsShard);
+        localMetricsShard = shard.get();
+        std::lock_guard<std::mutex> lock(metricsRegistryMutex);
+        metricsRegistry.push_back(std::move(shard));
     }
-    
-    extractMotion(inputVideo, outputVideo, frameDelay, args.overlay);
+    return *localMetricsShard;
+}
+
 
-    return 0;
+void addToCounter(std::atomic<unsigned long long>& counter, unsigned long long amount) {
+    // Shards have a single writer, so a relaxed load and store is enough and avoids a locked read-modify-write
+    counter.store(counter.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
 }
 
 
-arguments parseArgs(int argc, char* argv[]) {
-    auto printUsage = [](const std::string& programName) {
-        std::cout << "Usage: " << programName << " input_path output_path [-f frames | -s seconds] [-o] [-h]" \
-        << std::endl;
+void addToGauge(std::atomic<long long>& gauge, long long amount) {
+    // Like addToCounter(), for gauges kept as changes. --multi streams move between workers, so a gauge of one shard
+    // may go negative while the sum over all shards stays right
+    gauge.store(gauge.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+}
+
+
+void recordFrameLatency(metricsShard& shard, long long latencyNs) {
+    // Time from the start of decoding a frame to the end of encoding its output frame
+    double latencySeconds = latencyNs / 1e9;
+    int bucket = 0;
+    while (bucket < latencyBucketCount && latencySeconds > latencyBucketsSeconds[bucket]) ++bucket;
+    addToCounter(shard.latencyBuckets[bucket], 1);
+    addToCounter(shard.latencySumNs, latencyNs);
+}
+
+
+std::string formatMetrics() {
+    // Sum every shard and format the totals in the Prometheus text exposition format
+    unsigned long long decoded = 0, written = 0, dropped = 0, gated = 0, unreferenced = 0, latencySumNs = 0;
+    unsigned long long buckets[latencyBucketCount + 1] = {};
+    long long queueDepth = 0, queueCapacity = 0;
+    {
+        std::lock_guard<std::mutex> lock(metricsRegistryMutex);
+        for (const auto& shard : metricsRegistry) {
+            decoded += shard->framesDecoded.load(std::memory_order_relaxed);
+            written += shard->framesWritten.load(std::memory_order_relaxed);
+            dropped += shard->framesDropped.load(std::memory_order_relaxed);
+            gated += shard->framesGated.load(std::memory_order_relaxed);
+            unreferenced += shard->framesUnreferenced.load(std::memory_order_relaxed);
+            latencySumNs += shard->latencySumNs.load(std::memory_order_relaxed);
+            for (int i = 0; i <= latencyBucketCount; ++i) buckets[i] += shard->latencyBuckets[i].load(std::memory_order_relaxed);
+            queueDepth += shard->queueDepth.load(std::memory_order_relaxed);
+            queueCapacity += shard->queueCapacity.load(std::memory_order_relaxed);
+        }
+    }
+
+    auto metric = [](std::ostringstream& out, const char* name, const char* type, const char* help) {
+        out << "# HELP " << name << " " << help << "\n# TYPE " << name << " " << type << "\n";
     };
 
-    auto printHelp = [&printUsage](const std::string& programName) {
-        printUsage(programName);
-        std::cout << "\nArguments:" << std::endl;
-        std::cout << "  input_path         Path to input video file (MP4)" << std::endl;
-        std::cout << "  output_path        Path of output video file to save (MP4)" << std::endl;
-        std::cout << "\nOptions:" << std::endl;
-        std::cout << "  -f, --frames       Number of frames to offset by" << std::endl;
-        std::cout << "  -s, --seconds      Number of seconds to offset by" << std::endl;
-        std::cout << "  -o, --overlay      Overlay the extracted motion over the original video" << std::endl;
-        std::cout << "  -h, --help         Display this help message" << std::endl;
-        std::cout << "\nNOTE: --frames and --seconds are mutually exclusive." << std::endl;
-        std::cout << "A small offset shows fast movements in the video. A large offset shows slow movements in the video." << std::endl;
-        std::cout << "If -f or -s is set to 0, the output video shows change from the start of the video." << std::endl;
-        std::cout << "\nExample:" << std::endl;
-        std::cout << "  " << programName << " input.mp4 output.mp4 -s 1" << std::endl;
+    std::ostringstream out;
+    metric(out, "motion_frames_decoded_total", "counter", "Frames decoded from the input video.");
+    out << "motion_frames_decoded_total " << decoded << "\n";
+    metric(out, "motion_frames_written_total", "counter", "Motion frames written to the output video.");
+    out << "motion_frames_written_total " << written << "\n";
+    metric(out, "motion_frames_dropped_total", "counter", "Decoded frames that were empty or the wrong size and were skipped.");
+    out << "motion_frames_dropped_total " << dropped << "\n";
+    metric(out, "motion_frames_gated_total", "counter", "Motion frames not encoded because motion gating found no activity.");
+    out << "motion_frames_gated_total " << gated << "\n";
+    metric(out, "motion_frames_unreferenced_total", "counter", "Frames not compared because the frame at their offset was dropped.");
+    out << "motion_frames_unreferenced_total " << unreferenced << "\n";
+
+    metric(out, "motion_frame_latency_seconds", "histogram", "Time from decoding a frame to writing its motion frame.");
+    unsigned long long cumulative = 0;
+    for (int i = 0; i < latencyBucketCount; ++i) {
+        cumulative += buckets[i];
+        out << "motion_frame_latency_seconds_bucket{le=\"" << latencyBucketsSeconds[i] << "\"} " << cumulative << "\n";
+    }
+    cumulative += buckets[latencyBucketCount];
+    out << "motion_frame_latency_seconds_bucket{le=\"+Inf\"} " << cumulative << "\n";
+    out << "motion_frame_latency_seconds_sum " << latencySumNs / 1e9 << "\n";
+    out << "motion_frame_latency_seconds_count " << cumulative << "\n";
+
+    metric(out, "motion_queue_depth_frames", "gauge", "Frames held in the delay buffer.");
+    out << "motion_queue_depth_frames " << queueDepth << "\n";
+    metric(out, "motion_queue_capacity_frames", "gauge", "Frames the delay buffer holds once it is full.");
+    out << "motion_queue_capacity_frames " << queueCapacity << "\n";
+
+    // Memory is sampled here rather than in the frame loop
+    long rssKiB = readProcKiB("/proc/self/status", "VmRSS");
+    long peakKiB = readProcKiB("/proc/self/status", "VmHWM");
+    metric(out, "motion_resident_memory_bytes", "gauge", "Resident set size of the process.");
+    out << "motion_resident_memory_bytes " << rssKiB * 1024 << "\n";
+    metric(out, "motion_peak_resident_memory_bytes", "gauge", "Peak resident set size of the process.");
+    out << "motion_peak_resident_memory_bytes " << peakKiB * 1024 << "\n";
+
+    return out.str();
+}
+
+
+void startMetrics(const std::string& path, int port, double interval) {
+    // Open the HTTP socket up front so a port conflict is reported before any processing starts
+    metricsEnabled = true;
+    metricsPath = path;
+    metricsInterval = interval;
+
+    if (port > 0) {
+        metricsListenFD = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        int reuse = 1;
+        setsockopt(metricsListenFD, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+        sockaddr_in address = {};
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        address.sin_port = htons(static_cast<uint16_t>(port));
+        if (metricsListenFD < 0 || bind(metricsListenFD, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 \
+            || listen(metricsListenFD, 8) != 0) {
+            std::cerr << "Error: Could not listen for metrics on port " << port << std::endl;
+            std::exit(EXIT_FAILURE);
+        }
+    }
+
+    metricsThread = std::thread(runMetricsExporter);
+    std::atexit(stopMetrics);
+}
+
+
+void runMetricsExporter() {
+    // Serve scrapes and rewrite the metrics file until stopMetrics() is called
+    auto writeMetricsFile = []() {
+        // Write to a temporary file and rename it so the collector never reads a partial file
+        std::string temporaryPath = metricsPath + ".tmp";
+        {
+            std::ofstream out(temporaryPath);
+            out << formatMetrics();
+        }
+        std::rename(temporaryPath.c_str(), metricsPath.c_str());
     };
 
-    arguments args;
-    std::string programName = argv[0];
-    int opt;
-
-    // For getopt_long() -- allows for the long and short name of the option to be given (ex. -o vs. --overlay)
-    const char* const short_opts = "f:s:oh";
-    const option long_opts[] = {
-        {"frames",  required_argument, nullptr, 'f'},
-        {"seconds", required_argument, nullptr, 's'},
-        {"overlay", no_argument,       nullptr, 'o'},
-        {"help",    no_argument,       nullptr, 'h'},
-        {nullptr,   no_argument,       nullptr, 0}
+    std::chrono::steady_clock::time_point nextWrite = std::chrono::steady_clock::now();
+    while (!metricsStop.load()) {
+        if (!metricsPath.empty() && std::chrono::steady_clock::now() >= nextWrite) {
+            writeMetricsFile();
+            nextWrite += std::chrono::milliseconds(static_cast<long long>(metricsInterval * 1000));
+        }
+
+        // Wake up at least every 200 ms to notice stopMetrics()
+        pollfd listener = {metricsListenFD, POLLIN, 0};
+        if (poll(&listener, metricsListenFD >= 0 ? 1 : 0, 200) <= 0 || !(listener.revents & POLLIN)) continue;
+
+        int client = accept4(metricsListenFD, nullptr, nullptr, SOCK_CLOEXEC);
+        if (client < 0) continue;
+
+        // Any request path gets the metrics. Read the request so the client doesn't see a reset
+        timeval timeout = {1, 0};
+        setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        char request[1024];
+        ssize_t received = recv(client, request, sizeof(request), 0);
+        (void)received;
+
+        std::string body = formatMetrics();
+        std::string response = "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: " \
+        + std::to_string(body.size()) + "\r\nConnection: close\r\n\r\n" + body;
+        ssize_t sent = send(client, response.data(), response.size(), MSG_NOSIGNAL);
+        (void)sent;
+        close(client);
+    }
+
+    // Leave the final totals behind for the collector
+    if (!metricsPath.empty()) writeMetricsFile();
+}
+
+
+void stopMetrics() {
+    metricsStop.store(true);
+    if (metricsThread.joinable()) metricsThread.join();
+    if (metricsListenFD >= 0) close(metricsListenFD);
+}
+
+
+stageScope::stageScope(stageStats* totals_, unsigned long long pixels_) : totals(totals_), pixels(pixels_), startNs(0) {
+    if (totals == nullptr) return;
+    if (perfGroupFD >= 0) readHardwareCounters(startCounters);
+    startNs = traceNowNs();
+}
+
+
+stageScope::~stageScope() {
+    if (totals == nullptr) return;
+    totals->timeNs += traceNowNs() - startNs;
+    totals->calls += 1;
+    totals->pixels += pixels;
+
+    unsigned long long endCounters[COUNTER_COUNT];
+    if (perfGroupFD >= 0 && readHardwareCounters(endCounters)) {
+        for (int i = 0; i < COUNTER_COUNT; ++i) totals->counters[i] += endCounters[i] - startCounters[i];
+    }
+}
+
+
+void openHardwareCounters() {
+    // Open cycles, instructions, cache misses and branch misses as one group so they can be read with one syscall.
+    // The counters follow the calling thread only, which is the thread running the frame loop. Work that a stage hands
+    // to other threads is not counted, see stageUsesWorkers
+    const unsigned long long configs[COUNTER_COUNT] = {
+        PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES
     };
-    
-    // Set variables depending on command line args
-    while ((opt = getopt_long(argc, argv, short_opts, long_opts, nullptr)) != -1) {
-        switch (opt) {
-            case 'h':
-                printHelp(programName);
-                std::exit(EXIT_SUCCESS);
-            case 'f':
-                args.framesToSkip = std::stoi(optarg);
-                args.framesOption = true;
-                break;
-            case 's':
-                args.secondsToSkip = std::stoi(optarg);
-                args.secondsOption = true;
-                break;
-            case 'o':
-                args.overlay = true;
-                break;
-            case '?':
-                std::cerr << "Unknown option: " << static_cast<char>(optopt) << std::endl;
-                printUsage(programName);
-                std::exit(EXIT_FAILURE);
-            default:
-                break;
-        }
-    }
-
-    // The user may not provide both --frames and --seconds
-    if (args.framesOption && args.secondsOption) {
-        std::cerr << "Error: Options -f and -s are mutually exclusive." << std::endl;
-        printUsage(programName);
-        std::exit(EXIT_FAILURE);
-    }
-
-    // Either --frames or --seconds must be provided
-    if (!args.framesOption && !args.secondsOption) {
-        std::cerr << "Error: You must provide either a seconds or frames offset with -s or -f." << std::endl;
-        printUsage(programName);
-        std::exit(EXIT_FAILURE);
-    }
-
-    if (args.framesToSkip < 0) {
-        std::cerr << "Frames must be a positive number." << std::endl;
-        std::exit(EXIT_FAILURE);
-    }
-
-    if (args.secondsToSkip < 0) {
-        std::cerr << "Seconds must be a positive number." << std::endl;
-        std::exit(EXIT_FAILURE);
-    }
-
-    if (optind + 2 != argc) {
-        std::cerr << "Error: Expected input and output file paths." << std::endl;
-        printUsage(programName);
-        std::exit(EXIT_FAILURE);
+    int counterFDs[COUNTER_COUNT];
+
+    for (int i = 0; i < COUNTER_COUNT; ++i) {
+        perf_event_attr attr = {};
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = configs[i];
+        attr.disabled = (i == 0);   // The whole group is started through the leader
+        attr.exclude_kernel = 1;    // Allowed with perf_event_paranoid <= 2
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_GROUP;
+
+        counterFDs[i] = static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, i == 0 ? -1 : counterFDs[0], 0));
+        if (counterFDs[i] < 0) {
+            // Typical inside containers and VMs, or with a restrictive perf_event_paranoid
+            std::cerr << "Warning: Hardware counters are unavailable (" << std::strerror(errno) \
+            << "). --stats will only report timing." << std::endl;
+            for (int j = 0; j < i; ++j) close(counterFDs[j]);
+            return;
+        }
+    }
+
+    perfGroupFD = counterFDs[0];
+    ioctl(perfGroupFD, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+    ioctl(perfGroupFD, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+}
+
+
+bool readHardwareCounters(unsigned long long values[COUNTER_COUNT]) {
+    // With PERF_FORMAT_GROUP a read returns the number of counters followed by each counter's value
+    unsigned long long buffer[COUNTER_COUNT + 1];
+    if (read(perfGroupFD, buffer, sizeof(buffer)) != static_cast<ssize_t>(sizeof(buffer))) return false;
+    for (int i = 0; i < COUNTER_COUNT; ++i) values[i] = buffer[i + 1];
+    return true;
+}
+
+
+void printStats(const extractorStats& stats, const MotionExtractor::options& settings, const std::string& outputPath, double fps) {
+    // One row per stage. Hardware counter columns are only shown when the counters could be opened.
+    // outputPath is the encoded video, empty when nothing was encoded
+    bool counters = perfGroupFD >= 0;
+
+    std::cout << "\nStage statistics" << (counters ? "" : " (timing only)") << std::endl;
+    std::cout << std::left << std::setw(10) << "Stage" << std::right << std::setw(10) << "Calls" \
+    << std::setw(12) << "Time (ms)" << std::setw(10) << "ns/pixel";
+    if (counters) {
+        std::cout << std::setw(8) << "IPC" << std::setw(14) << "Cycles/pixel" \
+        << std::setw(16) << "Cache miss/px" << std::setw(16) << "Branch miss/px";
+    }
+    std::cout << std::endl;
+
+    std::cout << std::fixed;
+    bool partialCounters = false;   // A stage whose counters miss the work of other threads was printed
+    for (int i = 0; i < STAGE_COUNT; ++i) {
+        const stageStats& totals = stats.stages[i];
+        if (totals.calls == 0) continue;
+        // Buffer pops touch no pixels, so per-pixel figures for the buffer use the pixels pushed
+        double pixels = totals.pixels > 0 ? static_cast<double>(totals.pixels) : 1;
+        bool partial = counters && stageUsesWorkers[i];
+        partialCounters = partialCounters || partial;
+
+        std::cout << std::left << std::setw(10) << std::string(stageNames[i]) + (partial ? "*" : "") << std::right << std::setw(10) << totals.calls \
+        << std::setw(12) << std::setprecision(1) << totals.timeNs / 1e6 \
+        << std::setw(10) << std::setprecision(3) << totals.timeNs / pixels;
+        if (counters) {
+            double cycles = static_cast<double>(totals.counters[COUNTER_CYCLES]);
+            std::cout << std::setw(8) << std::setprecision(2) << (cycles > 0 ? totals.counters[COUNTER_INSTRUCTIONS] / cycles : 0) \
+            << std::setw(14) << std::setprecision(3) << cycles / pixels \
+            << std::setw(16) << std::setprecision(5) << totals.counters[COUNTER_CACHE_MISSES] / pixels \
+            << std::setw(16) << std::setprecision(5) << totals.counters[COUNTER_BRANCH_MISSES] / pixels;
+        }
+        std::cout << std::endl;
+    }
+    if (partialCounters) {
+        std::cout << "* Counters cover the frame loop thread only, not the work this stage runs on other threads" << std::endl;
+    }
+
+    const sparseStats& sparseTiming = stats.sparse;
+    if (settings.sparseThreshold >= 0 && sparseTiming.denseNs > 0) {
+        // Compare and post-process time per frame relative to the densely processed first frame
+        std::cout << "\nSparse processing (dense frame: " << std::setprecision(2) << sparseTiming.denseNs / 1e6 << " ms)" << std::endl;
+        for (int i = 0; i < sparseBuckets; ++i) {
+            if (sparseTiming.frames[i] == 0) continue;
+            double frameNs = static_cast<double>(sparseTiming.timeNs[i]) / sparseTiming.frames[i];
+            std::cout << "  " << std::setw(3) << i * 100 / sparseBuckets << "-" << std::setw(3) << (i + 1) * 100 / sparseBuckets \
+            << "% tiles changed: " << std::setw(8) << sparseTiming.frames[i] << " frames, " << std::setprecision(2) \
+            << frameNs / 1e6 << " ms/frame, " << sparseTiming.denseNs / frameNs << "x" << std::endl;
+        }
+    }
+
+    const stageStats& encode = stats.stages[STAGE_ENCODE];
+    struct stat output;
+    if (!outputPath.empty() && encode.calls > 0 && stat(outputPath.c_str(), &output) == 0) {
+        // The bitrate is the file size over the duration of the frames written, so container overhead is included
+        double seconds = fps > 0 ? encode.calls / fps : 0;
+        std::cout << "\nOutput" << std::endl;
+        std::cout << "  Frames encoded: " << encode.calls << std::endl;
+        std::cout << std::setprecision(1) << "  Encode speed: " << (encode.timeNs > 0 ? encode.calls * 1e9 / encode.timeNs : 0) << " fps" << std::endl;
+        std::cout << "  File size: " << output.st_size / 1048576.0 << " MiB";
+        if (seconds > 0) std::cout << ", " << output.st_size * 8 / seconds / 1000 << " kbit/s";
+        std::cout << std::endl;
+    }
+
+    const deadZoneStats& deadZone = stats.deadZone;
+    if (settings.deadZone > 0 && deadZone.pixels > 0) {
+        std::cout << "\nDead zone" << std::endl;
+        std::cout << std::setprecision(1) << "  Snapped to neutral: " << 100.0 * deadZone.snapped / deadZone.pixels \
+        << "% of " << deadZone.pixels << " compared pixels" << std::endl;
+    }
+
+    const memoryAccounting& memoryUsage = stats.memory;
+    std::cout << "\nMemory" << std::endl;
+    std::cout << std::setprecision(1);
+    for (const auto& entry : memoryUsage.bufferBytes) {
+        std::cout << "  Delay buffer (" << matTypeName(entry.first) << "): " << entry.second / 1048576.0 << " MiB at exit" << std::endl;
+    }
+    std::cout << "  Delay buffer peak: " << memoryUsage.peakBufferBytes / 1048576.0 << " MiB" << std::endl;
+    std::cout << "  Workspace peak: " << memoryUsage.peakWorkspaceBytes / 1048576.0 << " MiB" << std::endl;
+    std::cout << "  Peak live cv::Mat bytes: " << matAllocator.peakLiveBytes.load() / 1048576.0 << " MiB" << std::endl;
+    std::cout << "  Mat allocations: " << matAllocator.allocations.load() << " (" << std::setprecision(2) \
+    << (memoryUsage.frames > 0 ? static_cast<double>(matAllocator.allocations.load()) / memoryUsage.frames : 0) << " per frame)" << std::endl;
+    long peakKiB = readProcKiB("/proc/self/status", "VmHWM");
+    long pssKiB = readProcKiB("/proc/self/smaps_rollup", "Pss");
+    if (peakKiB >= 0) std::cout << "  Peak RSS: " << peakKiB / 1024 << " MiB" << std::endl;
+    if (pssKiB >= 0) std::cout << "  PSS at exit: " << pssKiB / 1024 << " MiB" << std::endl;
+}
+
+
+cv::UMatData* countingAllocator::allocate(int dims, const int* sizes, int type, void* data, size_t* step,
+                                          cv::AccessFlag flags, cv::UMatUsageFlags usageFlags) const {
+    cv::UMatData* u = inner->allocate(dims, sizes, type, data, step, flags, usageFlags);
+    if (u == nullptr) return u;
+
+    // Make the Mat hand the buffer back to us when it is released so the free is counted too
+    u->currAllocator = this;
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    long long live = liveBytes.fetch_add(u->size, std::memory_order_relaxed) + u->size;
+    long long peak = peakLiveBytes.load(std::memory_order_relaxed);
+    while (live > peak && !peakLiveBytes.compare_exchange_weak(peak, live, std::memory_order_relaxed)) {}
+    return u;
+}
+
+
+bool countingAllocator::allocate(cv::UMatData* data, cv::AccessFlag accessFlags, cv::UMatUsageFlags usageFlags) const {
+    return inner->allocate(data, accessFlags, usageFlags);
+}
+
+
+void countingAllocator::deallocate(cv::UMatData* data) const {
+    if (data == nullptr) return;
+    liveBytes.fetch_sub(data->size, std::memory_order_relaxed);
+    inner->deallocate(data);
+}
+
+
+void trackBufferBytes(memoryAccounting* memory, const cv::Mat& image, int direction) {
+    // direction is 1 when a frame enters the delay buffer and -1 when it leaves. Nothing is counted without memory
+    if (memory == nullptr) return;
+    memoryAccounting& memoryUsage = *memory;
+    long long bytes = static_cast<long long>(image.total() * image.elemSize()) * direction;
+    memoryUsage.bufferBytes[image.type()] += bytes;
+    memoryUsage.bufferTotalBytes += bytes;
+    if (memoryUsage.bufferTotalBytes > memoryUsage.peakBufferBytes) memoryUsage.peakBufferBytes = memoryUsage.bufferTotalBytes;
+}
+
+
+void sampleWorkspaceBytes(memoryAccounting* memory) {
+    // Everything the allocator has live that is not in the delay buffer: the decoded frame and per-frame temporaries.
+    // The allocator counts for the whole process, so with several extractors this includes the others' bytes
+    if (memory == nullptr) return;
+    memoryAccounting& memoryUsage = *memory;
+    memoryUsage.workspaceBytes = matAllocator.liveBytes.load(std::memory_order_relaxed) - memoryUsage.bufferTotalBytes;
+    if (memoryUsage.workspaceBytes > memoryUsage.peakWorkspaceBytes) memoryUsage.peakWorkspaceBytes = memoryUsage.workspaceBytes;
+    memoryUsage.frames += 1;
+}
+
+
+std::string matTypeName(int type) {
+    // For example CV_8UC3 -> "8UC3"
+    static const char* const depths[] = {"8U", "8S", "16U", "16S", "32S", "32F", "64F", "16F"};
+    return std::string(depths[CV_MAT_DEPTH(type)]) + "C" + std::to_string(CV_MAT_CN(type));
+}
+
+
+unsigned long bufferCapacity(unsigned long frameDelay, int fraction, unsigned long step) {
+    // Only the references of output frames are buffered. With --step those are one frame in every step, and the
+    // buffer holds the ones between the current frame and oldest frames back. A fractional offset needs the frame
+    // before each reference as well. Without --step that is the reference of the frame before, so nothing more
+    if (frameDelay == 0 && fraction == 0) return 0;
+    unsigned long oldest = frameDelay + (fraction > 0);
+    if (fraction == 0 || step == 1) return oldest / step + 1;
+    return oldest / step + (oldest - 1) / step + 2;
+}
+
+
+long long projectedMemory(unsigned long frameDelay, int fraction, cv::Size crop, const MotionExtractor::options& settings) {
+    // Add a few frames to the delay buffer for decode, output and temporaries, and the frames --pre-roll holds
+    long long frameBytes = static_cast<long long>(crop.width) * crop.height * (settings.gray ? 1 : 3);
+    long long preRoll = settings.gateThreshold >= 0 ? settings.preRoll : 0;
+    return frameBytes * (bufferCapacity(frameDelay, fraction, settings.step) + 4 + preRoll);
+}
+
+
+void warnIfMemoryShort(long long projected) {
+    long availableKiB = readProcKiB("/proc/meminfo", "MemAvailable");
+
+    if (availableKiB >= 0 && projected > availableKiB * 1024LL) {
+        std::cerr << "Warning: The delay buffer is projected to need " << projected / (1 << 20) << " MiB but only " \
+        << availableKiB / 1024 << " MiB of memory is available. Consider a shorter offset." << std::endl;
+    }
+}
+
+
+void openMotionStats(motionStatsWriter& writer, const std::string& path, double fps) {
+    // The binary sidecar starts with a small header, followed by one fixed-size record per output frame:
+    //   header: "MSTA", uint32 version, uint32 grid size, float fps
+    //   record: uint32 frame, float mean absolute difference, uint32 active pixels, uint8 grid[grid size * grid size]
+    // All fields are little-endian
+    std::ofstream& motionStatsFile = writer.file;
+    writer.csv = path.size() >= 4 && path.compare(path.size() - 4, 4, ".csv") == 0;
+    motionStatsFile.open(path, writer.csv ? std::ios::out : std::ios::out | std::ios::binary);
+    if (!motionStatsFile) throw std::runtime_error("Could not create the motion statistics file " + path);
+
+    if (writer.csv) {
+        motionStatsFile << "frame,time_s,mean_abs_diff,active_pixels";
+        for (int i = 0; i < motionGridSize * motionGridSize; ++i) motionStatsFile << ",cell" << i;
+        motionStatsFile << "\n";
     } else {
-        args.inputPath = argv[optind];
-        args.outputPath = argv[optind + 1];
+        const uint32_t version = 1;
+        const uint32_t gridSize = motionGridSize;
+        const float headerFPS = static_cast<float>(fps);
+        motionStatsFile.write("MSTA", 4);
+        motionStatsFile.write(reinterpret_cast<const char*>(&version), sizeof(version));
+        motionStatsFile.write(reinterpret_cast<const char*>(&gridSize), sizeof(gridSize));
+        motionStatsFile.write(reinterpret_cast<const char*>(&headerFPS), sizeof(headerFPS));
+    }
+}
+
+
+void writeMotionStats(motionStatsWriter& writer, unsigned long frameIndex, double fps, const motionStats& stats) {
+    // frameIndex is the source frame the statistics were measured on
+    std::ofstream& motionStatsFile = writer.file;
+    if (writer.csv) {
+        motionStatsFile << frameIndex << "," << (fps > 0 ? frameIndex / fps : 0) << "," << stats.meanAbsDiff << "," << stats.activePixels;
+        for (unsigned char cell : stats.grid) motionStatsFile << "," << static_cast<int>(cell);
+        motionStatsFile << "\n";
+        return;
     }
 
-    return args;
+    const uint32_t frame = static_cast<uint32_t>(frameIndex);
+    const float meanAbsDiff = static_cast<float>(stats.meanAbsDiff);
+    const uint32_t activePixels = static_cast<uint32_t>(stats.activePixels);
+    motionStatsFile.write(reinterpret_cast<const char*>(&frame), sizeof(frame));
+    motionStatsFile.write(reinterpret_cast<const char*>(&meanAbsDiff), sizeof(meanAbsDiff));
+    motionStatsFile.write(reinterpret_cast<const char*>(&activePixels), sizeof(activePixels));
+    motionStatsFile.write(reinterpret_cast<const char*>(stats.grid), sizeof(stats.grid));
 }
 
 
-void createGammaLUT(unsigned char lut[256], float gamma_) {
-    // Calculate every possible gamma value from 0 to 255 to speed up calculations later
+void openMaskStream(maskStreamWriter& writer, const std::string& path, double fps, cv::Size frameSize) {
+    // The layout is described in mask_stream.h. Masks cover the whole frame the output video would have
+    std::ofstream& maskStreamFile = writer.file;
+    maskStreamFile.open(path, std::ios::out | std::ios::binary);
+    if (!maskStreamFile) throw std::runtime_error("Could not create the mask stream " + path);
+
+    const uint32_t width = frameSize.width;
+    const uint32_t height = frameSize.height;
+    const float frameRate = static_cast<float>(fps);
+    maskStreamFile.write(maskStreamMagic, sizeof(maskStreamMagic));
+    maskStreamFile.write(reinterpret_cast<const char*>(&maskStreamVersion), sizeof(maskStreamVersion));
+    maskStreamFile.write(reinterpret_cast<const char*>(&width), sizeof(width));
+    maskStreamFile.write(reinterpret_cast<const char*>(&height), sizeof(height));
+    maskStreamFile.write(reinterpret_cast<const char*>(&frameRate), sizeof(frameRate));
+    writer.offset = maskStreamHeaderSize;
+    writer.index.clear();
+}
+
+
+void writeMaskFrame(maskStreamWriter& writer, unsigned long frameIndex, const cv::Mat& mask, const activeRegion& region) {
+    // mask covers region.crop. Rows are coded as alternating runs of unset and set pixels, with everything outside
+    // the crop unset
+    std::vector<unsigned char>& payload = writer.payload;
+    payload.clear();
+    auto putRun = [&payload](uint64_t run) {
+        for (; run >= 0x80; run >>= 7) payload.push_back(static_cast<unsigned char>((run & 0x7f) | 0x80));
+        payload.push_back(static_cast<unsigned char>(run));
+    };
+
+    const cv::Rect& crop = region.crop;
+    const int trailing = region.frameSize.width - crop.x - crop.width;
+    for (int y = 0; y < region.frameSize.height; ++y) {
+        if (y < crop.y || y >= crop.y + crop.height) {
+            putRun(region.frameSize.width);
+            continue;
+        }
+        const unsigned char* row = mask.ptr<unsigned char>(y - crop.y);
+        bool set = false;
+        uint64_t run = crop.x;
+        for (int x = 0; x < crop.width; ++x) {
+            if ((row[x] != 0) != set) {
+                putRun(run);
+                run = 0;
+                set = !set;
+            }
+            ++run;
+        }
+        if (set) {
+            putRun(run);
+            if (trailing > 0) putRun(trailing);
+        } else {
+            putRun(run + trailing);
+        }
+    }
+
+    const uint32_t frame = static_cast<uint32_t>(frameIndex);
+    const uint32_t size = static_cast<uint32_t>(payload.size());
+    writer.index.push_back(writer.offset);
+    writer.file.write(reinterpret_cast<const char*>(&frame), sizeof(frame));
+    writer.file.write(reinterpret_cast<const char*>(&size), sizeof(size));
+    writer.file.write(reinterpret_cast<const char*>(payload.data()), payload.size());
+    writer.offset += sizeof(frame) + sizeof(size) + payload.size();
+}
+
+
+void finishMaskStream(maskStreamWriter& writer) {
+    // The index and trailer go at the end so frames can be streamed out as they are made
+    std::ofstream& maskStreamFile = writer.file;
+    const uint64_t indexOffset = writer.offset;
+    const uint32_t frames = static_cast<uint32_t>(writer.index.size());
+    maskStreamFile.write(reinterpret_cast<const char*>(writer.index.data()), writer.index.size() * sizeof(uint64_t));
+    maskStreamFile.write(reinterpret_cast<const char*>(&indexOffset), sizeof(indexOffset));
+    maskStreamFile.write(reinterpret_cast<const char*>(&frames), sizeof(frames));
+    maskStreamFile.write(maskStreamIndexMagic, sizeof(maskStreamIndexMagic));
+    maskStreamFile.close();
+}
+
+
+void findBlobs(blobGrid& grid, const cv::Rect& crop, std::vector<motionBlob>& blobs) {
+    // Label the 8-connected blocks with motion using union-find, then gather each region's box, area and centroid.
+    // The blocks cover crop. Their counts are cleared on the way for the next frame
+    std::vector<int>& labels = grid.labels;
+    std::vector<int>& parent = grid.parent;
+    const int cols = grid.counts.cols;
+    const int rows = grid.counts.rows;
+    labels.assign(static_cast<size_t>(cols) * rows, -1);
+    parent.clear();
+
+    auto root = [&parent](int label) {
+        while (parent[label] != label) label = parent[label] = parent[parent[label]];
+        return label;
+    };
+    auto unite = [&root, &parent](int a, int b) {
+        a = root(a);
+        b = root(b);
+        if (a != b) parent[std::max(a, b)] = std::min(a, b);
+    };
+
+    for (int y = 0; y < rows; ++y) {
+        const unsigned short* count = grid.counts.ptr<unsigned short>(y);
+        int* label = labels.data() + static_cast<size_t>(y) * cols;
+        const int* above = y > 0 ? label - cols : nullptr;
+        for (int x = 0; x < cols; ++x) {
+            if (count[x] == 0) continue;
+            int current = -1;
+            const int neighbours[4] = {x > 0 ? label[x - 1] : -1, above && x > 0 ? above[x - 1] : -1,
+                                       above ? above[x] : -1, above && x + 1 < cols ? above[x + 1] : -1};
+            for (int neighbour : neighbours) {
+                if (neighbour < 0) continue;
+                if (current < 0) current = neighbour;
+                else unite(current, neighbour);
+            }
+            if (current < 0) {
+                current = static_cast<int>(parent.size());
+                parent.push_back(current);
+            }
+            label[x] = current;
+        }
+    }
+
+    // Second pass: one blob per root, numbered in order of first appearance
+    std::vector<int> blobIndex(parent.size(), -1);
+    blobs.clear();
+    const int size = 1 << grid.shift;
+    for (int y = 0; y < rows; ++y) {
+        unsigned short* count = grid.counts.ptr<unsigned short>(y);
+        const int* label = labels.data() + static_cast<size_t>(y) * cols;
+        for (int x = 0; x < cols; ++x) {
+            if (label[x] < 0) continue;
+            int r = root(label[x]);
+            if (blobIndex[r] < 0) {
+                blobIndex[r] = static_cast<int>(blobs.size());
+                blobs.push_back(motionBlob());
+                blobs.back().box = cv::Rect(x, y, 1, 1);
+            }
+            motionBlob& blob = blobs[blobIndex[r]];
+            blob.box |= cv::Rect(x, y, 1, 1);
+            blob.area += count[x];
+            blob.centerX += count[x] * (x + 0.5);
+            blob.centerY += count[x] * (y + 0.5);
+            count[x] = 0;
+        }
+    }
+
+    // Back from blocks to output video coordinates
+    for (motionBlob& blob : blobs) {
+        blob.centerX = blob.centerX / blob.area * size + crop.x;
+        blob.centerY = blob.centerY / blob.area * size + crop.y;
+        cv::Rect box(blob.box.x * size, blob.box.y * size, blob.box.width * size, blob.box.height * size);
+        blob.box = (box + crop.tl()) & crop;
+    }
+}
+
+
+void writeBlobs(std::ostream& blobsFile, unsigned long frameIndex, double fps, const std::vector<motionBlob>& blobs) {
+    // One JSON object per compared frame, with an empty list when nothing moved
+    blobsFile << "{\"frame\":" << frameIndex << ",\"time_s\":" << (fps > 0 ? frameIndex / fps : 0) << ",\"blobs\":[";
+    for (size_t i = 0; i < blobs.size(); ++i) {
+        const motionBlob& blob = blobs[i];
+        blobsFile << (i > 0 ? "," : "") << "{\"x\":" << blob.box.x << ",\"y\":" << blob.box.y << ",\"width\":" \
+        << blob.box.width << ",\"height\":" << blob.box.height << ",\"area\":" << blob.area << ",\"cx\":" \
+        << blob.centerX << ",\"cy\":" << blob.centerY << "}";
+    }
+    blobsFile << "]}\n";
+}
+
+
+bool isSceneCut(const motionStats& stats, double threshold, double& baseline) {
+    // A cut changes nearly the whole frame at once. The mean difference has to reach the threshold and jump well above
+    // its recent average, and at least 3/4 of the grid cells have to reach half the threshold, so a large object
+    // passing close to the camera isn't mistaken for a cut. baseline only follows frames within a scene
+    int changedCells = 0;
+    for (unsigned char cell : stats.grid) changedCells += cell >= threshold / 2;
+    bool cut = baseline >= 0 && stats.meanAbsDiff >= threshold && stats.meanAbsDiff >= sceneCutRatio * baseline \
+               && changedCells * 4 >= motionGridSize * motionGridSize * 3;
+    if (!cut) baseline = baseline < 0 ? stats.meanAbsDiff : 0.9 * baseline + 0.1 * stats.meanAbsDiff;
+    return cut;
+}
+
+
+void updateNoiseEstimate(noiseEstimate& noise, const unsigned int frameHistogram[256], double sigmas, int floor) {
+    // Smooth the histogram over roughly the last 10 frames and estimate the noise from it. The median luma is the noise
+    // floor, and 1.4826 times the median absolute deviation from it is sigma for Gaussian noise. The threshold never
+    // drops below floor, the fixed threshold, so clean footage gives the same mask as without --adaptive-threshold
+    unsigned long long total = 0;
+    for (int i = 0; i < 256; ++i) total += frameHistogram[i];
+    if (total == 0) return;
     for (int i = 0; i < 256; ++i) {
-        lut[i] = cv::saturate_cast<unsigned char>(cv::pow(i / 255.0, gamma_) * 255.0);
+        double fraction = static_cast<double>(frameHistogram[i]) / total;
+        noise.histogram[i] = noise.primed ? 0.9 * noise.histogram[i] + 0.1 * fraction : fraction;
+    }
+    noise.primed = true;
+
+    int median = 0;
+    for (double below = noise.histogram[0]; below < 0.5 && median < 255; below += noise.histogram[++median]) {}
+
+    int deviation = 0;
+    double within = noise.histogram[median];
+    while (within < 0.5 && deviation < 255) {
+        ++deviation;
+        if (median - deviation >= 0) within += noise.histogram[median - deviation];
+        if (median + deviation <= 255) within += noise.histogram[median + deviation];
     }
+
+    double sigma = 1.4826 * deviation;
+    int threshold = static_cast<int>(median + sigmas * sigma + 0.5);
+    noise.threshold = std::min(254, std::max(floor, threshold));
 }
 
 
-void applyGammaCorrection(cv::Mat& image) {
-    // Apply gamma correction using the lookup table
-    // Each channel gets gamma correction applied
-    cv::MatIterator_<cv::Vec3b> it, end;
-    for (it = image.begin<cv::Vec3b>(), end = image.end<cv::Vec3b>(); it != end; ++it) {
-        (*it)[0] = gammaLUT[(*it)[0]];
-        (*it)[1] = gammaLUT[(*it)[1]];
-        (*it)[2] = gammaLUT[(*it)[2]];
+void writeHeatmap(const motionHeatmap& heatmap, const std::string& path) {
+    // Scale the counts so the pixel that moved most is 255 and color them with the jet colormap
+    double maxCount = 0;
+    cv::minMaxLoc(heatmap.counts, nullptr, &maxCount);
+    cv::Mat scaled, colored;
+    heatmap.counts.convertTo(scaled, CV_8U, maxCount > 0 ? 255.0 / maxCount : 0);
+    cv::applyColorMap(scaled, colored, cv::COLORMAP_JET);
+
+    if (!cv::imwrite(path, colored)) throw std::runtime_error("Could not write the heatmap " + path);
+}
+
+
+gateDecision gateFrame(gateState& gate, bool moving, std::ostream& index) {
+    // Any motion opens a segment (or extends the open one) and restarts the post-roll countdown. A segment that ends
+    // is added to index
+    if (moving) {
+        gate.postRollLeft = gate.postRoll;
+        return GATE_WRITE;
+    }
+
+    if (gate.inSegment && gate.postRollLeft > 0) {
+        --gate.postRollLeft;
+        return GATE_WRITE;
+    }
+
+    if (gate.inSegment) finishSegment(gate, index);
+    return !gate.preRollFrames.empty() ? GATE_HOLD : GATE_SKIP;
+}
+
+
+bool holdPreRoll(gateState& gate, const cv::Mat& outputFrame, unsigned long frameIndex) {
+    // Overwrite the oldest slot once the ring is full. copyTo() reuses the slot's buffer. Returns whether that
+    // pushed a frame out of the ring without it being written
+    size_t slot = (gate.preRollStart + gate.preRollCount) % gate.preRollFrames.size();
+    outputFrame.copyTo(gate.preRollFrames[slot]);
+    gate.preRollIndices[slot] = frameIndex;
+    if (gate.preRollCount < gate.preRollFrames.size()) {
+        ++gate.preRollCount;
+        return false;
+    }
+    gate.preRollStart = (gate.preRollStart + 1) % gate.preRollFrames.size();
+    return true;
+}
+
+
+void writeGatedFrame(gateState& gate, const cv::Mat& outputFrame, unsigned long frameIndex, const MotionExtractor::callback& emit) {
+    // The first frame written after an idle stretch starts a new segment, led by whatever pre-roll is waiting
+    if (!gate.inSegment) {
+        gate.inSegment = true;
+        gate.segmentStart = gate.preRollCount > 0 ? gate.preRollIndices[gate.preRollStart] : frameIndex;
+        gate.segmentOutputStart = gate.framesWritten;
     }
+
+    for (; gate.preRollCount > 0; --gate.preRollCount) {
+        emit(gate.preRollFrames[gate.preRollStart], gate.preRollIndices[gate.preRollStart]);
+        gate.preRollStart = (gate.preRollStart + 1) % gate.preRollFrames.size();
+        ++gate.framesWritten;
+    }
+    gate.preRollStart = 0;
+
+    emit(outputFrame, frameIndex);
+    gate.lastWritten = frameIndex;
+    ++gate.framesWritten;
 }
 
 
-void compareFrames(const cv::Mat& src1, const cv::Mat& src2, cv::Mat& dst) {
-    dst = cv::Mat(src1.size(), src1.type());            // The output frame is the same size and type as the input frames
+void finishSegment(gateState& gate, std::ostream& index) {
+    // Add the open segment to the index. Times are positions in the input video
+    double fps = gate.fps > 0 ? gate.fps : 1;
+    index << gate.segmentStart << "," << gate.lastWritten << "," << gate.segmentStart / fps << "," \
+    << (gate.lastWritten + 1) / fps << "," << gate.segmentOutputStart << "\n";
+    gate.inSegment = false;
+}
 
-    cv::Mat inverted;
-    cv::bitwise_not(src2, inverted);                    // Get a negative color image of the second frame using bitwise not
 
-    cv::addWeighted(src1, 0.5, inverted, 0.5, 0, dst);  // Combine the first frame with the inverted frame
+void intersectSpans(const activeRegion& region, const std::vector<cv::Rect>& tiles, std::vector<cv::Rect>& out) {
+    // Clip tile runs from findChangedRegions() to the active spans. Each tile run lies within one tile row,
+    // so only the spans indexed for that row need to be checked
+    out.clear();
+    if (region.spans.size() == 1 && region.spans[0] == cv::Rect(cv::Point(0, 0), region.crop.size())) {
+        out = tiles;
+        return;
+    }
+    for (const cv::Rect& tile : tiles) {
+        for (int index : region.spansByTileRow[tile.y / sparseTileSize]) {
+            cv::Rect clipped = tile & region.spans[index];
+            if (!clipped.empty()) out.push_back(clipped);
+        }
+    }
 }
 
 
-void extractMotion(cv::VideoCapture& inputVideo, cv::VideoWriter& outputVideo, unsigned long frameDelay, bool overlay) {
-    std::queue<cv::Mat> frameQueue;     // Frame buffer to compare the current frame with old frames
-    cv::Mat frame, firstFrame;
+void countCellPixels(cv::Size size, const std::vector<cv::Rect>& spans, unsigned long long cellPixels[]) {
+    // Number of pixels of the spans in each motion statistics grid cell of an image of the given size
+    std::fill(cellPixels, cellPixels + motionGridSize * motionGridSize, 0ULL);
+    for (const cv::Rect& span : spans) {
+        for (int row = 0; row < motionGridSize; ++row) {
+            int y0 = std::max(span.y, row * size.height / motionGridSize);
+            int y1 = std::min(span.y + span.height, (row + 1) * size.height / motionGridSize);
+            if (y1 <= y0) continue;
+            for (int cell = 0; cell < motionGridSize; ++cell) {
+                int x0 = std::max(span.x, cell * size.width / motionGridSize);
+                int x1 = std::min(span.x + span.width, (cell + 1) * size.width / motionGridSize);
+                if (x1 > x0) cellPixels[row * motionGridSize + cell] += static_cast<unsigned long long>(x1 - x0) * (y1 - y0);
+            }
+        }
+    }
+}
+
+
+std::vector<cv::Rect> maskToRuns(const cv::Mat& mask, bool value) {
+    // Run-length encode the pixels of an 8-bit mask that are (value) non-zero. Runs with the same columns on
+    // consecutive rows are merged into one taller rectangle, so a rectangular region becomes a single run
+    std::vector<cv::Rect> runs;
+    std::vector<size_t> open;       // Runs that ended on the previous row and can still grow downwards
+    std::vector<size_t> stillOpen;
 
-    // If frameDelay is 0, we compare all video frames with the very first frame and don't need to use the buffer
-    if (frameDelay == 0) {
-        inputVideo >> firstFrame;   // Save the first frame of the video
+    for (int y = 0; y < mask.rows; ++y) {
+        const unsigned char* row = mask.ptr<unsigned char>(y);
+        stillOpen.clear();
+        size_t next = 0;            // Runs in open are in column order, like the runs found on this row
+        for (int x = 0; x < mask.cols;) {
+            if ((row[x] != 0) != value) {
+                ++x;
+                continue;
+            }
+            int start = x;
+            while (x < mask.cols && (row[x] != 0) == value) ++x;
+
+            while (next < open.size() && runs[open[next]].x < start) ++next;
+            if (next < open.size() && runs[open[next]].x == start && runs[open[next]].width == x - start) {
+                runs[open[next]].height += 1;
+                stillOpen.push_back(open[next]);
+            } else {
+                runs.push_back(cv::Rect(start, y, x - start, 1));
+                stillOpen.push_back(runs.size() - 1);
+            }
+        }
+        open.swap(stillOpen);
     }
+    return runs;
+}
 
-    while (inputVideo.read(frame)) {
-        // Fill the frame buffer with frameDelay number of frames before starting the comparisons
-        if (frameDelay > 0) {
-            frameQueue.push(frame.clone());
-            if (frameQueue.size() < frameDelay + 1) continue;
+
+void buildActiveRegion(activeRegion& region, cv::Size videoSize, const MotionExtractor::options& settings) {
+    // Combine the --roi rectangles (or the whole frame), the --mask image and the content inside any detected bars
+    // into region. ROIs and the mask are in video coordinates. Everything in region is relative to the decoded crop,
+    // which is the content with --autocrop-drop and else the whole frame, scaled down by --preview
+    const std::vector<cv::Rect>& rois = settings.rois;
+    const int previewLevels = settings.previewLevels;
+    cv::Size frameSize = videoSize;
+    cv::Rect whole(cv::Point(0, 0), videoSize);
+    cv::Rect content = settings.content.empty() ? whole : settings.content & whole;
+    cv::Rect decodeCrop = settings.dropBorders ? content : whole;
+    cv::Mat mask(frameSize, CV_8UC1, cv::Scalar::all(rois.empty() ? 255 : 0));
+    for (const cv::Rect& roi : rois) {
+        mask(roi & cv::Rect(cv::Point(0, 0), frameSize)).setTo(cv::Scalar::all(255));
+    }
+
+    for (int y = 0; y < frameSize.height; ++y) {
+        unsigned char* row = mask.ptr<unsigned char>(y);
+        for (int x = 0; x < frameSize.width; ++x) {
+            if (!content.contains(cv::Point(x, y))) row[x] = 0;
         }
+    }
 
-        cv::Mat outputFrame;
-        // Again, if frameDelay is 0 we don't use the buffer
-        if (frameDelay == 0) {
-            compareFrames(frame, firstFrame, outputFrame);
-        } else {
-            compareFrames(frame, frameQueue.front(), outputFrame);
-            frameQueue.pop();   // Remove the oldest frame from the buffer
-        }
-
-        // Overlay the motion frame over the original frame or apply some gamma correction to just the motion frame
-        if (overlay) {
-            // Convert the motion frame to grayscale
-            cv::cvtColor(outputFrame, outputFrame, cv::COLOR_BGR2GRAY);
-            // Set every pixel darker than (129, 129, 129) to black, and every pixel brighter to white
-            cv::threshold(outputFrame, outputFrame, 129, 255, cv::THRESH_BINARY);
-            // Apply some blur to make the overlay look a little nicer
-            cv::blur(outputFrame, outputFrame, cv::Size(3,3));
-            // Convert the grayscale image back to BGR (OpenCV default)
-            cv::cvtColor(outputFrame, outputFrame, cv::COLOR_GRAY2BGR);
-            // Using bitwise_or() will overlay the two frames
-            cv::bitwise_or(frame, outputFrame, outputFrame);
-        } else {
-            applyGammaCorrection(outputFrame);
+    if (!settings.mask.empty()) {
+        cv::Mat maskImage = settings.mask;
+        if (maskImage.size() != frameSize) {
+            // Masks drawn on a different resolution still line up after scaling
+            cv::resize(maskImage, maskImage, frameSize, 0, 0, cv::INTER_NEAREST);
+        }
+        for (int y = 0; y < frameSize.height; ++y) {
+            unsigned char* row = mask.ptr<unsigned char>(y);
+            const unsigned char* image = maskImage.ptr<unsigned char>(y);
+            for (int x = 0; x < frameSize.width; ++x) row[x] = image[x] != 0 ? row[x] : 0;
+        }
+    }
+
+    region.videoSize = videoSize;
+    region.frameSize = decodeCrop.size();
+    region.decodeCrop = decodeCrop;
+    mask = mask(decodeCrop);
+
+    if (previewLevels > 0) {
+        // Each level halves the size. Keep it even so the preview can still be encoded as 4:2:0
+        int width = std::max(2, (decodeCrop.width >> previewLevels) & ~1);
+        int height = std::max(2, (decodeCrop.height >> previewLevels) & ~1);
+        region.frameSize = cv::Size(width, height);
+        cv::resize(mask, mask, region.frameSize, 0, 0, cv::INTER_NEAREST);
+    }
+
+    std::vector<cv::Rect> spans = maskToRuns(mask, true);
+    if (spans.empty()) throw std::invalid_argument("The region of interest and mask leave nothing to process.");
+
+    region.crop = spans[0];
+    for (const cv::Rect& span : spans) region.crop |= span;
+    region.gaps = maskToRuns(mask, false);
+    region.spans.clear();
+    region.pixels = 0;
+    for (const cv::Rect& span : spans) {
+        region.spans.push_back(span - region.crop.tl());
+        region.pixels += span.area();
+    }
+
+    region.spansByTileRow.assign((region.crop.height + sparseTileSize - 1) / sparseTileSize, std::vector<int>());
+    for (size_t i = 0; i < region.spans.size(); ++i) {
+        const cv::Rect& span = region.spans[i];
+        for (int row = span.y / sparseTileSize; row <= (span.y + span.height - 1) / sparseTileSize; ++row) {
+            region.spansByTileRow[row].push_back(static_cast<int>(i));
         }
+    }
+
+    countCellPixels(region.crop.size(), region.spans, region.cellPixels);
+}
+
+
+cv::Rect detectBorders(const std::string& path, int frames, cv::Size videoSize) {
+    // Find constant bars along the edges of the first frames of the video. A row or column belongs to a bar when every
+    // pixel of it stays within a small tolerance of the bar's color in every sampled frame. Returns the content inside
+    const int tolerance = 12;
+    const cv::Rect whole(cv::Point(0, 0), videoSize);
+    cv::VideoCapture probe(path);
+    cv::Mat sample;
+    if (!probe.read(sample) || sample.size() != videoSize) return whole;
+
+    // The bar colors are taken from the corners of the first frame
+    const cv::Vec3b top = sample.at<cv::Vec3b>(0, 0);
+    const cv::Vec3b bottom = sample.at<cv::Vec3b>(sample.rows - 1, sample.cols - 1);
+    const cv::Vec3b left = top;
+    const cv::Vec3b right = bottom;
+    auto distance = [](const unsigned char* pixel, const cv::Vec3b& color) {
+        return std::max(std::abs(pixel[0] - color[0]), std::max(std::abs(pixel[1] - color[1]), std::abs(pixel[2] - color[2])));
+    };
+
+    // Largest distance from the bar color seen in each row and column, over all sampled frames
+    std::vector<int> rowDistance(sample.rows, 0), columnDistance(sample.cols, 0);
+    for (int sampled = 0; sampled < frames; ++sampled) {
+        if (sampled > 0 && (!probe.read(sample) || sample.size() != whole.size())) break;
+        for (int y = 0; y < sample.rows; ++y) {
+            const unsigned char* row = sample.ptr<unsigned char>(y);
+            const cv::Vec3b& rowColor = y < sample.rows / 2 ? top : bottom;
+            for (int x = 0; x < sample.cols; ++x) {
+                const cv::Vec3b& columnColor = x < sample.cols / 2 ? left : right;
+                rowDistance[y] = std::max(rowDistance[y], distance(row + x * 3, rowColor));
+                columnDistance[x] = std::max(columnDistance[x], distance(row + x * 3, columnColor));
+            }
+        }
+    }
+
+    int y0 = 0, y1 = sample.rows, x0 = 0, x1 = sample.cols;
+    while (y0 < y1 && rowDistance[y0] <= tolerance) ++y0;
+    while (y1 > y0 && rowDistance[y1 - 1] <= tolerance) --y1;
+    while (x0 < x1 && columnDistance[x0] <= tolerance) ++x0;
+    while (x1 > x0 && columnDistance[x1 - 1] <= tolerance) --x1;
+
+    // A frame with no content at all (for example a fade from black) is not letterboxed
+    if (y1 - y0 < 2 || x1 - x0 < 2) return whole;
 
-        outputVideo.write(outputFrame);
+    // Keep the content size even so the cropped output can still be encoded as 4:2:0
+    cv::Rect content(x0, y0, (x1 - x0) & ~1, (y1 - y0) & ~1);
+    if (content != whole) {
+        std::cerr << "Detected borders: content is " << content.width << "x" << content.height << " at (" << content.x \
+        << ", " << content.y << ") of " << whole.width << "x" << whole.height << std::endl;
     }
+    return content;
 }
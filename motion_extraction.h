@@ -0,0 +1,288 @@
+// Internal interface of libmotion, shared by the library and the command line tool: the kernels, the sidecar writers
+// and the instrumentation. Processing options belong to each MotionExtractor (MotionExtractor::options) and reach the
+// kernels as arguments. The globals left here are process-wide instrumentation: the trace, progress reports,
+// metrics, hardware counters and the allocation counts.
+
+#ifndef MOTION_EXTRACTION_H
+#define MOTION_EXTRACTION_H
+
+#include <mutex>                    // Guards registration of per-thread trace buffers and metrics shards
+#include <atomic>                   // Lock-free metrics counters
+#include <thread>                   // Metrics exporter thread
+#include <chrono>                   // Timestamps for trace events
+#include <memory>                   // std::unique_ptr
+#include <string>                   // Standard string operations
+#include <vector>                   // Per-thread trace event storage
+#include <csignal>                  // std::sig_atomic_t
+#include <cstdint>                  // Fixed-width fields in the binary sidecars
+#include <fstream>                  // Sidecar files
+
+#include "motion_extractor.h"       // MotionExtractor::callback and MotionExtractor::options
+
+#include <opencv2/core/types.hpp>
+#include <opencv2/core/utility.hpp>
+
+extern unsigned char gammaLUT[256]; // Lookup table to quickly apply gamma correction to frames
+
+const int maxBlurRadius = 63;       // Keeps the row counts of blurMask() within 8 bits
+const int blurStripWidth = 256;     // Columns per parallel strip in the vertical pass of blurMask()
+const int motionGridSize = 8;       // Motion statistics split each frame into a motionGridSize x motionGridSize grid
+
+struct motionStats {                // Per-frame statistics compareRegion() accumulates while it compares
+    double meanAbsDiff = 0;         // Mean absolute difference between the frames over all pixels and channels
+    unsigned long activePixels = 0; // Pixels that the overlay threshold would mark as motion
+    unsigned char grid[motionGridSize * motionGridSize] = {};  // Mean absolute difference of each grid cell, row major
+};
+
+struct motionHeatmap {              // How often each pixel moved over the whole video, for --heatmap
+    cv::Mat counts;                 // CV_32SC1, the frame size shifted right by shift
+    cv::Point origin;               // Position of the processed crop in the frame
+    int shift = 0;                  // log2 of the --heatmap-scale divisor
+};
+
+struct blobGrid {                   // Active pixels per block of the crop, which --blobs labels
+    cv::Mat counts;                 // CV_16UC1, the crop size shifted right by shift
+    int shift = 2;                  // log2 of the --blob-scale block size
+    std::vector<int> labels, parent;    // Union-find workspace of findBlobs(), reused between frames
+};
+
+struct motionBlob {                 // One connected region of motion, in output video coordinates
+    cv::Rect box;
+    unsigned long area = 0;         // Active pixels
+    double centerX = 0;             // Centroid of the active pixels, at block resolution
+    double centerY = 0;
+};
+
+struct motionAccumulator {          // Running sums behind motionStats, so a frame can be compared one region at a time
+    unsigned long long cellSums[motionGridSize * motionGridSize] = {};
+    unsigned long activePixels = 0;
+    motionHeatmap* heatmap = nullptr;   // Also count the active pixels into this heatmap when given
+    cv::Mat* mask = nullptr;        // Also write 255 for active pixels and 0 for the others here (CV_8UC1) when given
+    blobGrid* blocks = nullptr;     // Also count the active pixels of each block here when given. Must start at 0
+    unsigned int* histogram = nullptr;  // Also count the pixels at each of the 256 luma values here when given
+    int values = 3;                 // Values per pixel behind the sums: 3 for BGR, 1 with --gray
+    int threshold = overlayThreshold;   // Luma above which a pixel counts as active. --adaptive-threshold raises it
+};
+
+struct activeRegion {               // The part of each frame that is processed, from --roi, --mask and --autocrop
+    cv::Size videoSize;             // Size of the decoded frames
+    cv::Size frameSize;             // Size of the frames the extractor works on, after decodeCrop
+    cv::Rect decodeCrop;            // Part of each decoded frame that is kept. Smaller than the video with --autocrop-drop
+    cv::Rect crop;                  // Bounding box of the active pixels. Only this part of a frame is buffered
+    std::vector<cv::Rect> spans;    // Active pixels as run-length rectangles, relative to crop
+    std::vector<cv::Rect> gaps;     // Inactive pixels as run-length rectangles, relative to the full frame
+    std::vector<std::vector<int>> spansByTileRow;   // Indices of the spans that touch each row of sparse tiles
+    unsigned long long cellPixels[motionGridSize * motionGridSize] = {};  // Active pixels in each grid cell of crop
+    unsigned long long pixels = 0;  // Active pixels in total
+};
+
+struct traceEvent {                 // One complete ("X" phase) event in the Chrome trace
+    const char* stage;
+    long long startNs;
+    long long durationNs;
+    unsigned long frame;
+};
+
+struct traceBuffer {                // Events recorded by one thread. Only the owning thread appends to it
+    long threadID;
+    std::vector<traceEvent> events;
+};
+
+const size_t traceChunkEvents = 1 << 14;    // A thread appends its events to the trace file once it has this many
+
+struct traceScope {                 // Records the lifetime of the enclosing block as one trace event
+    traceScope(const char* stage_, unsigned long frame_);
+    ~traceScope();
+
+    const char* stage;
+    unsigned long frame;
+    long long startNs;
+};
+
+extern bool tracingEnabled;         // Set by startTrace(). When false a traceScope costs a single branch
+
+struct bufferedFrame {              // A frame kept in the delay buffer until it is needed as a reference
+    cv::Mat frame;                  // Only the active region
+    unsigned long sourceIndex;      // Index of the frame in the input video
+};
+
+
+struct progressState {              // Counters the frame loop keeps up to date for progress reports
+    std::chrono::steady_clock::time_point start;
+    std::chrono::steady_clock::time_point lastReport;
+    unsigned long framesDecoded = 0;
+    unsigned long framesAtLastReport = 0;
+    unsigned long long allocationsAtLastReport = 0;
+    double totalFrames = 0;         // CAP_PROP_FRAME_COUNT, which may be 0 or an estimate for some containers
+    size_t bufferSize = 0;
+    size_t bufferCapacity = 0;
+    const memoryAccounting* memory = nullptr;   // The extractor's, for the buffer and workspace bytes
+};
+
+extern double progressInterval;                 // Set by --progress
+extern int progressFD;                          // Set by --progress-fd
+extern volatile std::sig_atomic_t progressRequested;    // Set by SIGUSR1, cleared by whoever prints the report
+
+const double latencyBucketsSeconds[] = {0.001, 0.002, 0.005, 0.01, 0.02, 0.05, 0.1, 0.25, 0.5, 1.0};
+const int latencyBucketCount = sizeof(latencyBucketsSeconds) / sizeof(latencyBucketsSeconds[0]);
+
+struct metricsShard {               // Counters written by exactly one frame loop thread and read by the exporter
+    std::atomic<unsigned long long> framesDecoded{0};
+    std::atomic<unsigned long long> framesWritten{0};
+    std::atomic<unsigned long long> framesDropped{0};
+    std::atomic<unsigned long long> framesGated{0};
+    std::atomic<unsigned long long> framesUnreferenced{0};  // Not compared because their reference was dropped
+    std::atomic<unsigned long long> latencyBuckets[latencyBucketCount + 1] = {};   // The last bucket is +Inf
+    std::atomic<unsigned long long> latencySumNs{0};
+    std::atomic<long long> queueDepth{0};
+    std::atomic<long long> queueCapacity{0};
+    char padding[64];               // Keeps another thread's shard off this shard's last cache line
+};
+
+extern bool metricsEnabled;         // Set by --metrics-file or --metrics-port
+
+struct stageScope {                 // Attributes the time and counters of the enclosing block to a stage's totals
+    stageScope(stageStats* totals_, unsigned long long pixels_);    // Records nothing when totals_ is null
+    ~stageScope();
+
+    stageStats* totals;
+    unsigned long long pixels;
+    long long startNs;
+    unsigned long long startCounters[COUNTER_COUNT];
+};
+
+const char* const stageNames[STAGE_COUNT] = {"buffer", "compare", "gamma", "overlay", "encode"};
+// Stages that hand part of their work to other threads, which the hardware counters of the frame loop don't see:
+// the parallel passes of blurMask() and the encoder's own threads
+const bool stageUsesWorkers[STAGE_COUNT] = {false, false, false, true, true};
+
+struct countingAllocator : cv::MatAllocator {  // Wraps OpenCV's default allocator and counts what goes through it
+    cv::UMatData* allocate(int dims, const int* sizes, int type, void* data, size_t* step,
+                           cv::AccessFlag flags, cv::UMatUsageFlags usageFlags) const override;
+    bool allocate(cv::UMatData* data, cv::AccessFlag accessFlags, cv::UMatUsageFlags usageFlags) const override;
+    void deallocate(cv::UMatData* data) const override;
+
+    cv::MatAllocator* inner = nullptr;
+    // OpenCV's own worker threads may allocate, so these are updated with atomic read-modify-writes
+    mutable std::atomic<unsigned long long> allocations{0};
+    mutable std::atomic<long long> liveBytes{0};
+    mutable std::atomic<long long> peakLiveBytes{0};
+};
+
+extern countingAllocator& matAllocator;    // Never destroyed: OpenCV may free Mats during its own teardown
+
+struct blurWorkspace {              // Buffers blurMask() keeps from frame to frame
+    cv::Mat counts;                 // Set pixels in the horizontal window around each pixel
+    std::vector<int> xIndex, yIndex;    // Source column and row of every position the windows reach
+    std::vector<unsigned int> sums; // Running column sums of the vertical pass
+    cv::Size size;                  // Mask size and radius the indices were built for
+    int radius = -1;
+};
+
+struct motionStatsWriter {          // --motion-stats sidecar of one extractor
+    std::ofstream file;
+    bool csv = false;               // Text instead of the binary records
+};
+
+enum gateDecision {                 // What motion gating does with the current motion frame
+    GATE_WRITE,                     // Encode it, after any pre-roll frames that are waiting
+    GATE_HOLD,                      // Keep it in the pre-roll ring in case motion starts soon
+    GATE_SKIP                       // Drop it without post-processing
+};
+
+struct gateState {                  // Motion gating state carried from frame to frame
+    std::vector<cv::Mat> preRollFrames;         // Ring of the most recent post-processed frames while idle
+    std::vector<unsigned long> preRollIndices;  // Source frame index of each ring slot
+    size_t preRollStart = 0;
+    size_t preRollCount = 0;
+    unsigned long postRoll = 0;                 // Frames kept after the end of each segment
+    unsigned long postRollLeft = 0;
+    bool inSegment = false;
+    unsigned long segmentStart = 0;             // Source frame index of the first frame of the open segment
+    unsigned long segmentOutputStart = 0;       // Output frame index of the first frame of the open segment
+    unsigned long lastWritten = 0;              // Source frame index of the last encoded frame
+    unsigned long framesWritten = 0;
+    double fps = 0;                             // Converts frame indices to times in the index
+};
+
+
+const int sparseTileSize = 16;      // Sparse processing decides per sparseTileSize x sparseTileSize tile
+
+const int maxTimelapseWindow = 255; // The most frames a 16-bit signed sum of motion (-128 to 127 per frame) can hold
+
+struct maskStreamWriter {           // --mask-stream sidecar of one extractor
+    std::ofstream file;
+    uint64_t offset = 0;            // Bytes written so far
+    std::vector<uint64_t> index;    // File offset of each frame record
+    std::vector<unsigned char> payload;     // Reused to encode each frame
+};
+
+const double sceneCutRatio = 3;     // A cut also raises the mean difference this many times above its recent average
+
+struct noiseEstimate {              // Running histogram of the motion luma behind --adaptive-threshold
+    double histogram[256] = {};     // Exponentially smoothed fraction of the active pixels at each luma
+    bool primed = false;
+    int threshold = overlayThreshold;   // Threshold for the next frame
+};
+
+void createGammaLUT(unsigned char lut[256], float gamma_);
+void applyGammaCorrection(cv::Mat& image);
+unsigned long compareRegion(const cv::Mat& src1, const cv::Mat& src2, cv::Mat& dst, const cv::Rect& region,
+                            const MotionExtractor::options& settings, motionAccumulator* acc, cv::Mat* timelapse = nullptr,
+                            const cv::Mat* older = nullptr, int fraction = 0, cv::Mat* live = nullptr);
+unsigned long compareGrayRegion(const cv::Mat& src1, const cv::Mat& src2, cv::Mat& dst, const cv::Rect& region,
+                                const MotionExtractor::options& settings, motionAccumulator* acc, cv::Mat* timelapse,
+                                const cv::Mat* older, int fraction, cv::Mat* live);
+void finishTimelapse(cv::Mat& sums, cv::Mat& motion, int frames, timelapseMode mode);
+void finishMotionStats(const motionAccumulator& acc, const unsigned long long cellPixels[], motionStats& stats);
+void thresholdMotion(const cv::Mat& motion, cv::Mat& mask, int threshold);
+void overlayMotion(const cv::Mat& frame, cv::Mat& motion, const cv::Mat& mask);
+void blurMask(cv::Mat& mask, int radius, blurWorkspace& workspace);
+void fillStaticRegion(const cv::Mat& frame, cv::Mat& motion, bool overlay);
+double findChangedRegions(const cv::Mat& src1, const cv::Mat& src2, double threshold, std::vector<cv::Rect>& changed,
+                          std::vector<cv::Rect>& unchanged);
+void intersectSpans(const activeRegion& region, const std::vector<cv::Rect>& tiles, std::vector<cv::Rect>& out);
+void countCellPixels(cv::Size size, const std::vector<cv::Rect>& spans, unsigned long long cellPixels[]);
+void buildActiveRegion(activeRegion& region, cv::Size videoSize, const MotionExtractor::options& settings);
+cv::Rect detectBorders(const std::string& path, int frames, cv::Size videoSize);
+std::vector<cv::Rect> maskToRuns(const cv::Mat& mask, bool value);
+long long traceNowNs();
+bool startTrace(const std::string& path);
+void writeTraceEvents(const traceBuffer& buffer);
+void writeTrace();
+void requestProgress(int);
+long readProcKiB(const char* path, const char* field);
+void reportProgress(progressState& progress, bool force);
+metricsShard& threadMetrics();
+void addToCounter(std::atomic<unsigned long long>& counter, unsigned long long amount);
+void addToGauge(std::atomic<long long>& gauge, long long amount);
+void recordFrameLatency(metricsShard& shard, long long latencyNs);
+std::string formatMetrics();
+void startMetrics(const std::string& path, int port, double interval);
+void runMetricsExporter();
+void stopMetrics();
+void openHardwareCounters();
+bool readHardwareCounters(unsigned long long values[COUNTER_COUNT]);
+void printStats(const extractorStats& stats, const MotionExtractor::options& settings, const std::string& outputPath, double fps);
+void trackBufferBytes(memoryAccounting* memory, const cv::Mat& image, int direction);
+void sampleWorkspaceBytes(memoryAccounting* memory);
+std::string matTypeName(int type);
+unsigned long bufferCapacity(unsigned long frameDelay, int fraction, unsigned long step);
+long long projectedMemory(unsigned long frameDelay, int fraction, cv::Size crop, const MotionExtractor::options& settings);
+void warnIfMemoryShort(long long projectedBytes);
+void openMotionStats(motionStatsWriter& writer, const std::string& path, double fps);
+void writeMotionStats(motionStatsWriter& writer, unsigned long frameIndex, double fps, const motionStats& stats);
+void writeHeatmap(const motionHeatmap& heatmap, const std::string& path);
+void openMaskStream(maskStreamWriter& writer, const std::string& path, double fps, cv::Size frameSize);
+void writeMaskFrame(maskStreamWriter& writer, unsigned long frameIndex, const cv::Mat& mask, const activeRegion& region);
+void finishMaskStream(maskStreamWriter& writer);
+void findBlobs(blobGrid& grid, const cv::Rect& crop, std::vector<motionBlob>& blobs);
+void writeBlobs(std::ostream& out, unsigned long frameIndex, double fps, const std::vector<motionBlob>& blobs);
+bool isSceneCut(const motionStats& stats, double threshold, double& baseline);
+void updateNoiseEstimate(noiseEstimate& noise, const unsigned int frameHistogram[256], double sigmas, int floor);
+gateDecision gateFrame(gateState& gate, bool moving, std::ostream& index);
+bool holdPreRoll(gateState& gate, const cv::Mat& outputFrame, unsigned long frameIndex);
+void writeGatedFrame(gateState& gate, const cv::Mat& outputFrame, unsigned long frameIndex, const MotionExtractor::callback& emit);
+void finishSegment(gateState& gate, std::ostream& index);
+
+#endif
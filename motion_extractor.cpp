@@ -0,0 +1,674 @@
+#include <deque>                    // Delay buffer and frames waiting for pull()
+#include <cmath>                    // std::lround() for fractional offsets
+#include <vector>
+#include <algorithm>                // std::min()
+#include <stdexcept>                // Invalid options and sidecars that can't be written
+
+#include "motion_extractor.h"
+#include "motion_extraction.h"      // Kernels, sidecar writers and instrumentation
+
+#include <opencv2/imgproc.hpp>
+
+struct MotionExtractor::state {     // Everything a clip changes from frame to frame
+    options settings;
+    activeRegion region;
+    double fps = 0;
+    unsigned long frameDelay = 0;
+    int referenceFraction = 0;
+    bool overlay = false;
+    unsigned long outputStep = 1;   // options::step
+    bool cropped = false;           // The active region is smaller than the frame
+    bool dropBorders = false;       // --autocrop-drop leaves the bars out
+    bool downscale = false;         // --preview
+    bool fractional = false;
+    bool buffered = false;          // Frames are compared with the buffer rather than the first frame
+    unsigned long oldest = 0;       // Furthest frame back an output frame is compared with
+
+    unsigned long frameIndex = 0;   // Index of the next frame, used to label trace events
+    cv::Size frameSize;             // Size of the first frame. Frames of any other size are dropped
+    std::deque<bufferedFrame> frameQueue;   // Frame buffer to compare the current frame with old frames
+    std::vector<cv::Mat> spareFrames;       // Buffers of frames that left frameQueue, reused for the next ones
+    cv::Mat firstFrame;             // Reference of every frame when the offset is 0
+    cv::Mat previewFrame;           // Reused target of the --preview downscale
+    cv::Mat grayFrame;              // Reused target of the --gray conversion
+    cv::Mat outputFrame;            // Reused for every frame
+    bool gapsFilled = false;        // The inactive part of outputFrame already holds the plain mode fill
+    cv::Mat neutralFrame;           // Written after a scene cut in plain mode
+    cv::Mat motionMask;             // For --mask-stream. The kernel only writes it where it compares
+    cv::Mat overlayMask;            // Overlay mask of the whole crop, blurred in one pass
+    blurWorkspace overlayBlur;      // Reused by every blur of overlayMask
+    cv::Mat timelapseSums;          // Motion of the current --timelapse window, relative to neutral gray
+    int windowFrames = 0;           // Motion frames in the current --timelapse window
+    cv::Mat deadZoneLive;           // 1 where a pixel moved in the previous frame, for --dead-zone hysteresis
+    std::vector<cv::Rect> changedTiles, staticTiles, changedRegions, staticRegions;
+    std::vector<motionBlob> blobs;
+    motionStats frameStats;
+    int threshold = overlayThreshold;   // Overlay threshold of the current frame
+    noiseEstimate noise;            // --adaptive-threshold
+    double cutBaseline = -1;        // Recent average of the mean difference, for scene cut detection
+    unsigned long sceneStart = 0;   // First frame of the current scene
+    gateState gate;
+
+    // Sidecars named by the options, and what they accumulate over the clip
+    motionStatsWriter motionStatsOut;
+    maskStreamWriter maskStreamOut;
+    std::ofstream blobsFile;
+    blobGrid blobBlocks;
+    std::ofstream gateIndexFile;
+    motionHeatmap heatmap;
+    sparseStats sparseTiming;
+
+    callback onFrame;
+    sceneCutCallback onSceneCut;
+    std::deque<bufferedFrame> ready;        // Motion frames waiting for pull()
+    std::vector<cv::Mat> spareOutputs;      // Buffers handed back through pull(), reused for the next ones
+
+    bool outputNeeded(unsigned long index) const;
+    bool referenceNeeded(unsigned long index) const;
+    cv::Mat prepare(const cv::Mat& decodedFrame, unsigned long index);
+    void release(bufferedFrame& entry);
+    void emit(const cv::Mat& frame, unsigned long index);
+    void writeNeutralFrame(const cv::Mat& frame, unsigned long index);
+    stageStats* stage(pipelineStage which) const;
+    memoryAccounting* memory() const;   // Null when nobody reads the memory use, which skips the accounting
+    void openSidecars();
+    void closeSidecars();
+};
+
+
+void validateOptions(const MotionExtractor::options& settings, double offsetFrames);
+
+
+MotionExtractor::MotionExtractor() : s(new state) {}
+
+
+MotionExtractor::MotionExtractor(cv::Size videoSize, double fps, double offsetFrames, const options& settings) : s(new state) {
+    start(videoSize, fps, offsetFrames, settings);
+}
+
+
+MotionExtractor::~MotionExtractor() = default;
+
+
+void MotionExtractor::start(cv::Size videoSize, double fps, double offsetFrames, const options& settings) {
+    // Reset everything that belongs to the previous clip. create() keeps a buffer whose size and type already match,
+    // so clips of the same format allocate nothing new. Nothing changes when the options are rejected
+    static const bool gammaReady = (createGammaLUT(gammaLUT, 1/1.1), true);
+    (void)gammaReady;
+
+    validateOptions(settings, offsetFrames);
+    activeRegion region;
+    buildActiveRegion(region, videoSize, settings);
+    unsigned long frameDelay;
+    int referenceFraction;
+    splitOffset(offsetFrames, frameDelay, referenceFraction);
+
+    state& st = *s;
+    st.closeSidecars();
+    for (bufferedFrame& entry : st.frameQueue) st.release(entry);
+    st.frameQueue.clear();
+    if (!st.firstFrame.empty()) trackBufferBytes(st.memory(), st.firstFrame, -1);
+    st.firstFrame.release();
+
+    st.settings = settings;
+    st.region = region;
+    st.fps = fps;
+    st.frameDelay = frameDelay;
+    st.referenceFraction = referenceFraction;
+    st.overlay = settings.overlay;
+    st.outputStep = settings.step;
+    st.cropped = region.crop.size() != region.frameSize;
+    st.dropBorders = region.decodeCrop.size() != region.videoSize;
+    st.downscale = region.frameSize != region.decodeCrop.size();
+    st.fractional = referenceFraction > 0;
+    st.buffered = frameDelay > 0 || st.fractional;
+    st.oldest = frameDelay + st.fractional;
+
+    st.frameIndex = 0;
+    st.frameSize = cv::Size();
+    st.gapsFilled = false;
+    const int channels = settings.gray ? 1 : 3;
+    if (settings.sceneCutThreshold >= 0 && !settings.overlay) {
+        st.neutralFrame.create(region.frameSize, CV_MAKETYPE(CV_8U, channels));
+        st.neutralFrame.setTo(cv::Scalar::all(gammaLUT[128]));
+    }
+    if (!settings.maskStreamPath.empty()) {
+        st.motionMask.create(region.crop.size(), CV_8UC1);
+        st.motionMask.setTo(cv::Scalar::all(0));
+    }
+    if (settings.timelapseWindow > 0) {
+        st.timelapseSums.create(region.crop.size(), CV_MAKETYPE(CV_16S, channels));
+        st.timelapseSums.setTo(cv::Scalar::all(0));
+    }
+    st.windowFrames = 0;
+    if (settings.deadZone > 0 && settings.deadZoneHold >= 0) {
+        st.deadZoneLive.create(region.crop.size(), CV_8UC1);
+        st.deadZoneLive.setTo(cv::Scalar::all(0));
+    }
+
+    st.threshold = settings.threshold;
+    st.noise = noiseEstimate();
+    st.noise.threshold = settings.threshold;
+    st.cutBaseline = -1;
+    st.sceneStart = 0;
+
+    const unsigned long preRoll = settings.gateThreshold >= 0 ? settings.preRoll : 0;
+    std::vector<cv::Mat> preRollFrames;
+    preRollFrames.swap(st.gate.preRollFrames);
+    st.gate = gateState();
+    st.gate.preRollFrames.swap(preRollFrames);
+    st.gate.preRollFrames.resize(preRoll);
+    st.gate.preRollIndices.resize(preRoll);
+    st.gate.postRoll = settings.postRoll;
+    st.gate.fps = fps;
+    st.sparseTiming = sparseStats();
+
+    for (bufferedFrame& entry : st.ready) st.spareOutputs.push_back(entry.frame);
+    st.ready.clear();
+
+    st.openSidecars();
+}
+
+
+void validateOptions(const MotionExtractor::options& settings, double offsetFrames) {
+    // The command line reports these with its own messages before an extractor exists. This is for other callers
+    auto check = [](bool valid, const char* message) {
+        if (!valid) throw std::invalid_argument(message);
+    };
+    check(offsetFrames >= 0, "The offset must not be negative.");
+    check(settings.threshold >= 0 && settings.threshold <= 254, "The threshold must be between 0 and 254.");
+    check(settings.blurRadius >= 0 && settings.blurRadius <= maxBlurRadius, "The blur radius must be between 0 and 63.");
+    check(settings.deadZone >= 0 && settings.deadZone <= 127 && settings.deadZoneHold >= -1 \
+          && settings.deadZoneHold <= settings.deadZone,
+          "The dead zone must be between 0 and 127, and the hysteresis distance no larger than it.");
+    check(settings.step >= 1, "The step must be at least 1.");
+    check(settings.timelapseWindow >= 0 && settings.timelapseWindow <= maxTimelapseWindow,
+          "The timelapse window must be between 0 and 255 frames.");
+    check(settings.previewLevels >= 0, "Preview levels must not be negative.");
+    check(settings.heatmapScale >= 1 && settings.heatmapScale <= 16 && (settings.heatmapScale & (settings.heatmapScale - 1)) == 0,
+          "The heatmap scale must be 1, 2, 4, 8 or 16.");
+    check(settings.blobScale >= 1 && settings.blobScale <= 16 && (settings.blobScale & (settings.blobScale - 1)) == 0,
+          "The blob scale must be 1, 2, 4, 8 or 16.");
+    check(settings.mask.empty() || settings.mask.type() == CV_8UC1, "The mask must be a CV_8UC1 image.");
+    check(!settings.heatmapOnly || !settings.heatmapPath.empty(), "heatmapOnly requires a heatmap path.");
+    check(settings.gateThreshold < 0 || (settings.timelapseWindow == 0 && !settings.heatmapOnly),
+          "Gating can't be combined with a timelapse or heatmapOnly.");
+}
+
+
+void MotionExtractor::state::openSidecars() {
+    // Everything a sidecar writes is relative to the output video, so they are set up once the region is known
+    if (!settings.motionStatsPath.empty()) openMotionStats(motionStatsOut, settings.motionStatsPath, fps);
+    if (!settings.maskStreamPath.empty()) openMaskStream(maskStreamOut, settings.maskStreamPath, fps, region.frameSize);
+
+    heatmap.counts.release();
+    if (!settings.heatmapPath.empty()) {
+        heatmap.shift = 0;
+        while ((1 << heatmap.shift) < settings.heatmapScale) ++heatmap.shift;
+        cv::Size size((region.frameSize.width + settings.heatmapScale - 1) >> heatmap.shift,
+                      (region.frameSize.height + settings.heatmapScale - 1) >> heatmap.shift);
+        heatmap.counts = cv::Mat::zeros(size, CV_32SC1);
+        heatmap.origin = region.crop.tl();
+    }
+
+    if (!settings.blobsPath.empty()) {
+        blobsFile.open(settings.blobsPath);
+        if (!blobsFile) throw std::runtime_error("Could not create the blob file " + settings.blobsPath);
+        blobBlocks.shift = 0;
+        while ((1 << blobBlocks.shift) < settings.blobScale) ++blobBlocks.shift;
+        cv::Size size((region.crop.width + settings.blobScale - 1) >> blobBlocks.shift,
+                      (region.crop.height + settings.blobScale - 1) >> blobBlocks.shift);
+        blobBlocks.counts = cv::Mat::zeros(size, CV_16UC1);
+    }
+
+    if (settings.gateThreshold >= 0 && !settings.gateIndexPath.empty()) {
+        gateIndexFile.open(settings.gateIndexPath);
+        if (!gateIndexFile) throw std::runtime_error("Could not create the segment index " + settings.gateIndexPath);
+        gateIndexFile << "start_frame,end_frame,start_s,end_s,output_start_frame\n";
+    }
+}
+
+
+void MotionExtractor::state::closeSidecars() {
+    // Leaves the files of a clip that wasn't finished as they are
+    if (motionStatsOut.file.is_open()) motionStatsOut.file.close();
+    if (maskStreamOut.file.is_open()) maskStreamOut.file.close();
+    if (blobsFile.is_open()) blobsFile.close();
+    if (gateIndexFile.is_open()) gateIndexFile.close();
+}
+
+
+stageStats* MotionExtractor::state::stage(pipelineStage which) const {
+    return settings.stats != nullptr ? &settings.stats->stages[which] : nullptr;
+}
+
+
+memoryAccounting* MotionExtractor::state::memory() const {
+    return settings.stats != nullptr ? &settings.stats->memory : nullptr;
+}
+
+
+bool MotionExtractor::state::outputNeeded(unsigned long index) const {
+    return index % outputStep == 0 && index >= oldest;
+}
+
+
+bool MotionExtractor::state::referenceNeeded(unsigned long index) const {
+    // With --step most frames are neither written nor the reference of a written frame. With a fractional offset
+    // the first frame would only be the newer reference of a frame too early to be written
+    return buffered && (((index + frameDelay) % outputStep == 0 && index + frameDelay >= oldest)
+                        || (fractional && (index + oldest) % outputStep == 0));
+}
+
+
+bool MotionExtractor::wants() const {
+    const state& st = *s;
+    // If the offset is 0, every frame is compared with the very first frame, so that one is always needed
+    if (!st.buffered && st.firstFrame.empty()) return true;
+    return st.outputNeeded(st.frameIndex) || st.referenceNeeded(st.frameIndex);
+}
+
+
+void MotionExtractor::skip() {
+    ++s->frameIndex;
+}
+
+
+cv::Mat MotionExtractor::state::prepare(const cv::Mat& decodedFrame, unsigned long index) {
+    // With --autocrop-drop everything after this point works on the frame without its bars. --gray converts before
+    // anything else, so the downscale, the buffer and the kernel see a third of the data
+    cv::Mat frame = dropBorders ? decodedFrame(region.decodeCrop) : decodedFrame;
+    if (settings.gray) {
+        traceScope scope("gray", index);
+        cv::cvtColor(frame, grayFrame, cv::COLOR_BGR2GRAY);
+        frame = grayFrame;
+    }
+    if (downscale) {
+        // --preview runs the whole pipeline on a box-filtered copy. INTER_AREA averages each block of source pixels
+        traceScope scope("downscale", index);
+        cv::resize(frame, previewFrame, region.frameSize, 0, 0, cv::INTER_AREA);
+        frame = previewFrame;
+    }
+    return frame;
+}
+
+
+void MotionExtractor::state::release(bufferedFrame& entry) {
+    // The buffer goes back to the pool for the next frame that is kept
+    trackBufferBytes(memory(), entry.frame, -1);
+    spareFrames.push_back(entry.frame);
+    entry.frame.release();
+}
+
+
+void MotionExtractor::state::emit(const cv::Mat& frame, unsigned long index) {
+    if (onFrame) {
+        onFrame(frame, index);
+        return;
+    }
+    ready.push_back(bufferedFrame{cv::Mat(), index});
+    if (frame.data == outputFrame.data) {
+        // The output frame itself is queued and the next one is written to a spare buffer, so nothing is copied.
+        // The spare buffer doesn't hold the plain mode fill of the inactive part yet
+        std::swap(ready.back().frame, outputFrame);
+        if (!spareOutputs.empty()) {
+            outputFrame = spareOutputs.back();
+            spareOutputs.pop_back();
+        }
+        gapsFilled = false;
+        return;
+    }
+    if (!spareOutputs.empty()) {
+        ready.back().frame = spareOutputs.back();
+        spareOutputs.pop_back();
+    }
+    frame.copyTo(ready.back().frame);
+}
+
+
+void MotionExtractor::state::writeNeutralFrame(const cv::Mat& frame, unsigned long index) {
+    // Nothing after a cut can be compared within the same scene yet, so show no motion: neutral gray, or the
+    // frame itself with --overlay. Skipped when asked to, and when the output isn't one frame per compared frame
+    if (settings.sceneCutSkip || settings.gateThreshold >= 0 || settings.timelapseWindow > 0 || settings.heatmapOnly) return;
+    emit(overlay ? frame : neutralFrame, index);
+}
+
+
+void MotionExtractor::push(const cv::Mat& decodedFrame) {
+    state& st = *s;
+    const options& settings = st.settings;
+    const activeRegion& region = st.region;
+    const unsigned long frameIndex = st.frameIndex++;
+    metricsShard* metrics = metricsEnabled ? &threadMetrics() : nullptr;
+    const bool firstNeeded = !st.buffered && st.firstFrame.empty();
+    const bool outputNeeded = !firstNeeded && st.outputNeeded(frameIndex);
+    const bool referenceNeeded = st.referenceNeeded(frameIndex);
+    if (!firstNeeded && !outputNeeded && !referenceNeeded) return;
+
+    // A damaged stream can decode to an empty frame or one with a different size, which can't be compared
+    if (st.frameSize.area() == 0) st.frameSize = decodedFrame.size();
+    if (decodedFrame.empty() || decodedFrame.size() != st.frameSize) {
+        if (metrics) addToCounter(metrics->framesDropped, 1);
+        return;
+    }
+    cv::Mat frame = st.prepare(decodedFrame, frameIndex);
+    cv::Mat frameCrop = st.cropped ? frame(region.crop) : frame;   // The active part of the current frame
+
+    if (firstNeeded) {
+        frameCrop.copyTo(st.firstFrame);
+        trackBufferBytes(st.memory(), st.firstFrame, 1);
+        return;
+    }
+
+    // Keep the frames that later output frames are compared with. Only the active region is buffered
+    if (referenceNeeded) {
+        traceScope scope("buffer", frameIndex);
+        stageScope stage(st.stage(STAGE_BUFFER), frameCrop.total());
+        st.frameQueue.push_back(bufferedFrame{cv::Mat(), frameIndex});
+        if (!st.spareFrames.empty()) {
+            st.frameQueue.back().frame = st.spareFrames.back();
+            st.spareFrames.pop_back();
+        }
+        frameCrop.copyTo(st.frameQueue.back().frame);
+        trackBufferBytes(st.memory(), st.frameQueue.back().frame, 1);
+    }
+    if (!outputNeeded) return;
+
+    // The buffer is in source order. References of dropped output frames are discarded, and an output frame
+    // whose reference was dropped is skipped rather than compared at the wrong offset
+    while (st.buffered && !st.frameQueue.empty() && st.frameQueue.front().sourceIndex < frameIndex - st.oldest) {
+        st.release(st.frameQueue.front());
+        st.frameQueue.pop_front();
+    }
+    bool referenceMissing = st.buffered && (st.frameQueue.empty() || st.frameQueue.front().sourceIndex != frameIndex - st.oldest);
+    if (st.fractional && !referenceMissing) {
+        referenceMissing = st.frameQueue.size() < 2 || st.frameQueue[1].sourceIndex != frameIndex - st.frameDelay;
+    }
+    if (referenceMissing) {
+        // Until the buffer refills after a scene cut there is no reference from the same scene
+        if (frameIndex - st.oldest < st.sceneStart) st.writeNeutralFrame(frame, frameIndex);
+        else if (metrics) addToCounter(metrics->framesUnreferenced, 1);
+        return;
+    }
+
+    // Again, if the offset is 0 we don't use the buffer. With a fractional offset the oldest frame is mixed in
+    const cv::Mat& reference = !st.buffered ? st.firstFrame : st.frameQueue[st.fractional ? 1 : 0].frame;
+    const cv::Mat* older = st.fractional ? &st.frameQueue.front().frame : nullptr;
+    // Sparse processing starts on the second compared frame. The first is processed densely to time the dense path
+    const bool sparseEnabled = settings.sparseThreshold >= 0;
+    const bool adaptive = settings.adaptiveSigmas >= 0;
+    const bool heatmapEnabled = !st.heatmap.counts.empty();
+    const bool maskStreamEnabled = st.maskStreamOut.file.is_open();
+    const bool blobsEnabled = st.blobsFile.is_open();
+    const bool gatingEnabled = settings.gateThreshold >= 0;
+    const bool sceneCutEnabled = settings.sceneCutThreshold >= 0;
+    bool sparse = sparseEnabled && st.sparseTiming.denseNs >= 0;
+    double motionFraction = 1;
+    long long processStartNs = sparseEnabled ? traceNowNs() : 0;
+    // The heatmap is counted in the statistics pass of the kernel
+    motionStats* wantStats = st.motionStatsOut.file.is_open() || gatingEnabled || heatmapEnabled || maskStreamEnabled
+                             || blobsEnabled || sceneCutEnabled || adaptive ? &st.frameStats : nullptr;
+
+    // Inactive pixels never change in plain mode, so they are only filled when the output frame is set up
+    cv::Mat& outputFrame = st.outputFrame;
+    if (!st.gapsFilled) {
+        outputFrame.create(frame.size(), frame.type());
+        if (!st.overlay) {
+            for (const cv::Rect& gap : region.gaps) {
+                cv::Mat motion = outputFrame(gap);
+                fillStaticRegion(frame(gap), motion, st.overlay);
+            }
+        }
+        st.gapsFilled = true;
+    }
+    cv::Mat motionCrop = st.cropped ? outputFrame(region.crop) : outputFrame;
+    std::vector<cv::Rect>& changedRegions = st.changedRegions;
+    std::vector<cv::Rect>& staticRegions = st.staticRegions;
+
+    {
+        traceScope scope("compare", frameIndex);
+        stageScope stage(st.stage(STAGE_COMPARE), region.pixels);
+        if (sparse) {
+            motionFraction = findChangedRegions(frameCrop, reference, settings.sparseThreshold, st.changedTiles, st.staticTiles);
+            intersectSpans(region, st.changedTiles, changedRegions);
+            intersectSpans(region, st.staticTiles, staticRegions);
+        } else {
+            changedRegions = region.spans;
+            staticRegions.clear();
+        }
+
+        // The threshold only changes between frames, so the kernel and the overlay use the same one
+        unsigned int lumaHistogram[256] = {};
+        motionAccumulator acc;
+        acc.values = frameCrop.channels();
+        if (adaptive) {
+            st.threshold = st.noise.threshold;
+            acc.histogram = lumaHistogram;
+        }
+        acc.threshold = st.threshold;
+        if (heatmapEnabled) acc.heatmap = &st.heatmap;
+        if (blobsEnabled) acc.blocks = &st.blobBlocks;
+        if (!st.motionMask.empty()) {
+            acc.mask = &st.motionMask;
+            for (const cv::Rect& r : staticRegions) st.motionMask(r).setTo(cv::Scalar::all(0));
+        }
+        unsigned long snapped = 0;
+        for (const cv::Rect& r : changedRegions) {
+            snapped += compareRegion(frameCrop, reference, motionCrop, r, settings, wantStats ? &acc : nullptr,
+                                     settings.timelapseWindow > 0 ? &st.timelapseSums : nullptr, older,
+                                     st.referenceFraction, st.deadZoneLive.empty() ? nullptr : &st.deadZoneLive);
+        }
+        if (settings.deadZone != 0 && settings.stats != nullptr) {
+            // Counted once per frame rather than per row, and only for this extractor
+            deadZoneStats& deadZone = settings.stats->deadZone;
+            for (const cv::Rect& r : changedRegions) deadZone.pixels += r.area();
+            deadZone.snapped += snapped;
+        }
+        if (wantStats) finishMotionStats(acc, region.cellPixels, st.frameStats);
+        if (adaptive) {
+            // Active pixels that weren't compared, like unchanged sparse tiles, are identical: luma 128
+            unsigned long long compared = 0;
+            for (unsigned int count : lumaHistogram) compared += count;
+            lumaHistogram[128] += static_cast<unsigned int>(region.pixels - compared);
+            updateNoiseEstimate(st.noise, lumaHistogram, settings.adaptiveSigmas, settings.threshold);
+        }
+    }
+    if (st.motionStatsOut.file.is_open()) writeMotionStats(st.motionStatsOut, frameIndex, st.fps, st.frameStats);
+    if (maskStreamEnabled) writeMaskFrame(st.maskStreamOut, frameIndex, st.motionMask, region);
+    if (blobsEnabled) {
+        traceScope scope("blobs", frameIndex);
+        findBlobs(st.blobBlocks, region.crop, st.blobs);
+        writeBlobs(st.blobsFile, frameIndex, st.fps, st.blobs);
+    }
+    // Remove the frames the next output frame doesn't need. With a fractional offset and --step that is both
+    // references, without --step the newer one stays as the next frame's older reference
+    if (st.buffered) {
+        traceScope scope("buffer", frameIndex);
+        stageScope stage(st.stage(STAGE_BUFFER), 0);
+        while (!st.frameQueue.empty() && st.frameQueue.front().sourceIndex < frameIndex + st.outputStep - st.oldest) {
+            st.release(st.frameQueue.front());
+            st.frameQueue.pop_front();
+        }
+    }
+
+    // After a scene cut the buffered frames belong to the old scene. Start over from this frame
+    if (sceneCutEnabled && isSceneCut(st.frameStats, settings.sceneCutThreshold, st.cutBaseline)) {
+        if (st.onSceneCut) st.onSceneCut(frameIndex, st.fps > 0 ? frameIndex / st.fps : 0);
+        st.sceneStart = frameIndex;
+        while (!st.frameQueue.empty() && st.frameQueue.front().sourceIndex < frameIndex) {
+            st.release(st.frameQueue.front());
+            st.frameQueue.pop_front();
+        }
+        if (!st.buffered) {
+            trackBufferBytes(st.memory(), st.firstFrame, -1);
+            frameCrop.copyTo(st.firstFrame);
+            trackBufferBytes(st.memory(), st.firstFrame, 1);
+        }
+        // The cut frame is already in the --timelapse sums, so the window starts over
+        if (settings.timelapseWindow > 0) {
+            st.timelapseSums.setTo(cv::Scalar::all(0));
+            st.windowFrames = 0;
+        }
+        st.writeNeutralFrame(frame, frameIndex);
+        return;
+    }
+
+    if (settings.heatmapOnly) return;
+
+    // --timelapse only post-processes and encodes the accumulated motion once per window
+    if (settings.timelapseWindow > 0) {
+        if (++st.windowFrames < settings.timelapseWindow) return;
+        for (const cv::Rect& span : region.spans) {
+            cv::Mat sums = st.timelapseSums(span);
+            cv::Mat motion = motionCrop(span);
+            finishTimelapse(sums, motion, st.windowFrames, settings.timelapseAccumulation);
+        }
+        changedRegions = region.spans;
+        staticRegions.clear();
+        st.windowFrames = 0;
+    }
+
+    // Motion gating decides before post-processing whether this frame is encoded, held for pre-roll or dropped
+    gateDecision decision = gatingEnabled ? gateFrame(st.gate, st.frameStats.meanAbsDiff >= settings.gateThreshold, st.gateIndexFile)
+                                          : GATE_WRITE;
+    if (decision == GATE_SKIP) {
+        if (metrics) addToCounter(metrics->framesGated, 1);
+        return;
+    }
+
+    // Overlay the motion frame over the original frame or apply some gamma correction to just the motion frame
+    {
+        traceScope scope("post-process", frameIndex);
+        stageScope stage(st.stage(st.overlay ? STAGE_OVERLAY : STAGE_GAMMA), region.pixels);
+        if (st.overlay) {
+            // One mask for the whole crop, so the blur runs once and smooths across the edges of spans and sparse
+            // tiles. Pixels outside the compared regions, including unchanged tiles, stay 0 like pixels that didn't
+            // move. The OR covers every active pixel, so the blurred edge reaches into unchanged tiles as well
+            st.overlayMask.create(motionCrop.size(), CV_8UC1);
+            st.overlayMask.setTo(cv::Scalar::all(0));
+            for (const cv::Rect& r : changedRegions) {
+                cv::Mat mask = st.overlayMask(r);
+                thresholdMotion(motionCrop(r), mask, st.threshold);
+            }
+            if (settings.blurRadius > 0) blurMask(st.overlayMask, settings.blurRadius, st.overlayBlur);
+            for (const cv::Rect& r : region.spans) {
+                cv::Mat motion = motionCrop(r);
+                overlayMotion(frameCrop(r), motion, st.overlayMask(r));
+            }
+        } else {
+            for (const cv::Rect& r : changedRegions) {
+                cv::Mat motion = motionCrop(r);
+                applyGammaCorrection(motion);
+            }
+            for (const cv::Rect& r : staticRegions) {
+                cv::Mat motion = motionCrop(r);
+                fillStaticRegion(frameCrop(r), motion, st.overlay);
+            }
+        }
+        // The overlay shows the current frame wherever nothing is processed
+        if (st.overlay) {
+            for (const cv::Rect& gap : region.gaps) {
+                cv::Mat motion = outputFrame(gap);
+                fillStaticRegion(frame(gap), motion, st.overlay);
+            }
+        }
+    }
+
+    if (sparseEnabled) {
+        long long processNs = traceNowNs() - processStartNs;
+        if (!sparse) {
+            st.sparseTiming.denseNs = processNs;
+        } else {
+            int bucket = std::min(sparseBuckets - 1, static_cast<int>(motionFraction * sparseBuckets));
+            st.sparseTiming.frames[bucket] += 1;
+            st.sparseTiming.timeNs[bucket] += processNs;
+        }
+    }
+
+    sampleWorkspaceBytes(st.memory());
+
+    if (decision == GATE_HOLD) {
+        // A held frame only counts as gated once it leaves the ring unwritten, since a segment may still flush it
+        bool evicted = holdPreRoll(st.gate, outputFrame, frameIndex);
+        if (metrics && evicted) addToCounter(metrics->framesGated, 1);
+        return;
+    }
+
+    if (gatingEnabled) {
+        writeGatedFrame(st.gate, outputFrame, frameIndex, [&st](const cv::Mat& out, unsigned long index) {
+            st.emit(out, index);
+        });
+    } else {
+        st.emit(outputFrame, frameIndex);
+    }
+}
+
+
+void MotionExtractor::finish() {
+    // Complete the sidecars. The heatmap is only written now because it covers the whole clip
+    state& st = *s;
+    if (st.gate.inSegment) finishSegment(st.gate, st.gateIndexFile);
+    // Pre-roll frames still held at the end are never written
+    if (metricsEnabled && st.gate.preRollCount > 0) addToCounter(threadMetrics().framesGated, st.gate.preRollCount);
+    st.gate.preRollCount = 0;
+    if (st.maskStreamOut.file.is_open()) finishMaskStream(st.maskStreamOut);
+    st.closeSidecars();
+    if (st.settings.stats != nullptr) st.settings.stats->sparse = st.sparseTiming;
+    if (!st.heatmap.counts.empty()) writeHeatmap(st.heatmap, st.settings.heatmapPath);
+}
+
+
+bool MotionExtractor::pull(cv::Mat& output, unsigned long* frameIndex) {
+    state& st = *s;
+    if (st.ready.empty()) return false;
+    std::swap(output, st.ready.front().frame);
+    if (frameIndex != nullptr) *frameIndex = st.ready.front().sourceIndex;
+    if (!st.ready.front().frame.empty()) st.spareOutputs.push_back(st.ready.front().frame);
+    st.ready.pop_front();
+    return true;
+}
+
+
+void MotionExtractor::setCallback(callback onFrame) {
+    s->onFrame = onFrame;
+}
+
+
+void MotionExtractor::setSceneCutCallback(sceneCutCallback onCut) {
+    s->onSceneCut = onCut;
+}
+
+
+cv::Size MotionExtractor::outputSize() const {
+    return s->region.frameSize;
+}
+
+
+size_t MotionExtractor::buffered() const {
+    return s->frameQueue.size();
+}
+
+
+const MotionExtractor::options& MotionExtractor::settings() const {
+    return s->settings;
+}
+
+
+size_t MotionExtractor::bufferCapacity() const {
+    return ::bufferCapacity(s->frameDelay, s->referenceFraction, s->outputStep);
+}
+
+
+long long MotionExtractor::projectedMemory() const {
+    return ::projectedMemory(s->frameDelay, s->referenceFraction, s->region.crop.size(), s->settings);
+}
+
+
+void splitOffset(double offsetFrames, unsigned long& frameDelay, int& referenceFraction) {
+    frameDelay = static_cast<unsigned long>(offsetFrames);
+    referenceFraction = static_cast<int>(std::lround((offsetFrames - frameDelay) * 256));
+    if (referenceFraction == 256) {
+        ++frameDelay;
+        referenceFraction = 0;
+    }
+}
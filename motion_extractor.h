@@ -0,0 +1,167 @@
+// libmotion's streaming interface. A MotionExtractor turns a sequence of decoded frames into motion frames: frames are
+// pushed in decode order, and motion frames come back through pull() or a callback.
+//
+// Each extractor has its own options, given to start(), so extractors with different settings can run side by side.
+// Everything that changes from frame to frame, like the delay buffer, lives in the extractor, and its buffers are kept
+// when start() begins the next clip. The only files an extractor touches are the sidecars its options name.
+// Invalid options throw std::invalid_argument, and sidecars that can't be written throw std::runtime_error.
+
+#ifndef MOTION_EXTRACTOR_H
+#define MOTION_EXTRACTOR_H
+
+#include <map>                      // Delay buffer bytes by storage type
+#include <memory>                   // std::unique_ptr for the extractor state
+#include <string>                   // Sidecar paths
+#include <vector>                   // Regions of interest
+#include <functional>               // Output callback
+
+#include <opencv2/core.hpp>
+
+const int overlayThreshold = 129;   // Motion pixels with a luma above this are part of the overlay mask
+
+enum timelapseMode {                // How --timelapse collapses a window of motion frames into one
+    TIMELAPSE_MAX,                  // Keep the value that moved furthest from neutral gray
+    TIMELAPSE_MEAN                  // Average the values
+};
+
+// What an extractor measures when options::stats points at one of these. The extractor only adds to it, on the
+// thread that pushes the frames, so the caller reads it between frames or after finish()
+enum pipelineStage {                // Stages that --stats attributes time and hardware counters to
+    STAGE_BUFFER,
+    STAGE_COMPARE,
+    STAGE_GAMMA,
+    STAGE_OVERLAY,
+    STAGE_ENCODE,
+    STAGE_COUNT
+};
+
+enum hardwareCounter {              // Order of the counters in the perf_event group
+    COUNTER_CYCLES,
+    COUNTER_INSTRUCTIONS,
+    COUNTER_CACHE_MISSES,
+    COUNTER_BRANCH_MISSES,
+    COUNTER_COUNT
+};
+
+struct stageStats {                 // Totals for one pipeline stage
+    unsigned long long calls = 0;
+    unsigned long long pixels = 0;
+    long long timeNs = 0;
+    unsigned long long counters[COUNTER_COUNT] = {};   // Stay 0 unless the process opened the hardware counters
+};
+
+struct memoryAccounting {           // Bytes held by one extractor, updated by its own thread only
+    std::map<int, long long> bufferBytes;   // Delay buffer bytes by cv::Mat type
+    long long bufferTotalBytes = 0;
+    long long peakBufferBytes = 0;
+    long long workspaceBytes = 0;           // Live Mat bytes of the process outside this delay buffer, sampled once per frame
+    long long peakWorkspaceBytes = 0;
+    unsigned long long frames = 0;
+};
+
+const int sparseBuckets = 10;       // --stats groups frames into this many motion fraction ranges
+
+struct sparseStats {                // Sparse processing cost by fraction of changed tiles, for --stats
+    long long denseNs = -1;         // Compare and post-process time of the first frame, which is processed densely
+    unsigned long frames[sparseBuckets] = {};
+    long long timeNs[sparseBuckets] = {};
+};
+
+struct deadZoneStats {              // How much --dead-zone snapped, for --stats
+    unsigned long long pixels = 0;  // Pixels compared
+    unsigned long long snapped = 0; // Pixels set to neutral
+};
+
+struct extractorStats {             // What one extractor measured, for --stats. Given through MotionExtractor::options
+    stageStats stages[STAGE_COUNT]; // The caller adds the encode stage
+    sparseStats sparse;             // Filled in by MotionExtractor::finish()
+    memoryAccounting memory;
+    deadZoneStats deadZone;         // Only counted when options::deadZone isn't 0
+};
+
+struct motionOptions {              // How a MotionExtractor processes a clip. The defaults are those of the command line
+    bool overlay = false;           // Show the motion over the frame instead of on neutral gray (--overlay)
+    bool gray = false;              // Compare luma only and output single-channel frames (--gray)
+    int threshold = overlayThreshold;   // Motion luma above which a pixel is part of the overlay mask
+    int blurRadius = 1;             // Box blur radius of the overlay mask, 0 to 63 (--blur)
+    int deadZone = 0;               // Snap motion within this distance of neutral to neutral, 0 disables it (--dead-zone)
+    int deadZoneHold = -1;          // Distance that snaps a pixel that moved in the previous frame, -1 disables hysteresis
+    unsigned long step = 1;         // Only every step-th frame is compared and output (--step)
+    int timelapseWindow = 0;        // Collapse this many motion frames into one, 0 disables it (--timelapse)
+    timelapseMode timelapseAccumulation = TIMELAPSE_MAX;
+    double sceneCutThreshold = -1;  // Mean difference that can start a scene cut, -1 disables detection (--scene-cut)
+    bool sceneCutSkip = false;      // Output nothing until the buffer refills after a cut, instead of neutral frames
+    double adaptiveSigmas = -1;     // Raise the threshold this many noise sigmas above the floor, -1 disables it
+    double sparseThreshold = -1;    // Only process tiles whose sampled difference exceeds this, -1 disables it
+    double gateThreshold = -1;      // Only output frames whose mean difference reaches this, -1 disables gating (--gate)
+    unsigned long preRoll = 0;      // Frames output before each gated segment
+    unsigned long postRoll = 0;     // Frames output after each gated segment
+
+    // The part of each frame that is processed. Rectangles and the mask are in video coordinates
+    std::vector<cv::Rect> rois;     // Only process these rectangles. Empty is the whole frame (--roi)
+    cv::Mat mask;                   // CV_8UC1. Only process pixels where it isn't 0. Scaled to the video size (--mask)
+    cv::Rect content;               // Picture inside letterbox bars, from detectBorders(). Empty is the whole frame
+    bool dropBorders = false;       // Leave the bars around content out of the motion frames (--autocrop-drop)
+    int previewLevels = 0;          // Halve the resolution this many times before processing (--preview)
+
+    // Sidecar files. An empty path writes nothing. finish() completes them
+    std::string motionStatsPath;    // Per-frame motion statistics, CSV if the name ends in .csv
+    std::string heatmapPath;        // Image of how often each pixel moved, written by finish()
+    int heatmapScale = 1;           // Divide the heatmap size by 1, 2, 4, 8 or 16
+    bool heatmapOnly = false;       // Only count the heatmap. No motion frames are output
+    std::string maskStreamPath;     // Motion mask of every compared frame, see mask_stream.h
+    std::string blobsPath;          // Connected regions of motion of every compared frame, as JSON lines
+    int blobScale = 4;              // Find regions on blocks of 1, 2, 4, 8 or 16 pixels square
+    std::string gateIndexPath;      // Input ranges kept by gating, as CSV
+
+    extractorStats* stats = nullptr;    // Add stage timings, memory use and dead zone counts here when given (--stats)
+};
+
+
+class MotionExtractor {
+public:
+    // Receives each motion frame as soon as it is ready. The frame is only valid during the call
+    typedef std::function<void(const cv::Mat& frame, unsigned long frameIndex)> callback;
+    // Receives the source frame index and time in seconds of each cut options::sceneCutThreshold detects
+    typedef std::function<void(unsigned long frameIndex, double seconds)> sceneCutCallback;
+
+    typedef motionOptions options;
+
+    MotionExtractor();
+    // Same as calling start() on a new extractor
+    MotionExtractor(cv::Size videoSize, double fps, double offsetFrames, const options& settings = options());
+    MotionExtractor(const MotionExtractor&) = delete;
+    MotionExtractor& operator=(const MotionExtractor&) = delete;
+    ~MotionExtractor();
+
+    // Begin a clip of BGR frames of videoSize. offsetFrames is the distance between compared frames and may be
+    // fractional. Opens the sidecars the options name
+    void start(cv::Size videoSize, double fps, double offsetFrames, const options& settings = options());
+
+    bool wants() const;             // Whether the next frame is used. If not, skip() it instead of decoding it
+    void push(const cv::Mat& frame);
+    void skip();
+    void finish();                  // Call after the last frame of a clip. Writes the heatmap and closes the sidecars
+
+    // Take the oldest motion frame that is ready. The buffer previously held by output is kept for reuse, so don't
+    // hold on to other references to it. Returns false when nothing is ready
+    bool pull(cv::Mat& output, unsigned long* frameIndex = nullptr);
+    // With a callback set, motion frames are handed to it directly and never queued for pull()
+    void setCallback(callback onFrame);
+    void setSceneCutCallback(sceneCutCallback onCut);
+
+    const options& settings() const;
+    cv::Size outputSize() const;    // Size of the motion frames. They have one channel with options::gray, else three
+    size_t buffered() const;        // Frames in the delay buffer
+    size_t bufferCapacity() const;  // Most frames the delay buffer will hold
+    long long projectedMemory() const;  // Bytes the delay buffer and working frames are expected to need
+
+private:
+    struct state;
+    std::unique_ptr<state> s;
+};
+
+// Split an offset in frames into whole frames and 1/256 frame, rounding to the nearest 1/256
+void splitOffset(double offsetFrames, unsigned long& frameDelay, int& referenceFraction);
+
+#endif
@@ -0,0 +1,91 @@
+#include "work_pool.h"
+
+thread_local const workPool* currentPool = nullptr;     // Pool the calling thread works for, if any
+thread_local size_t currentWorker = 0;
+
+
+workPool::workPool(int threadCount) {
+    if (threadCount < 1) threadCount = 1;
+    for (int i = 0; i < threadCount; ++i) workers.emplace_back(new worker);
+    for (size_t i = 0; i < workers.size(); ++i) threadHandles.emplace_back(&workPool::run, this, i);
+}
+
+
+workPool::~workPool() {
+    wait();
+    {
+        std::lock_guard<std::mutex> lock(sleepMutex);
+        stopping = true;
+    }
+    workAvailable.notify_all();
+    for (std::thread& thread : threadHandles) thread.join();
+}
+
+
+void workPool::submit(task work) {
+    size_t target = currentPool == this ? currentWorker : nextWorker.fetch_add(1, std::memory_order_relaxed) % workers.size();
+    unfinished.fetch_add(1);
+    {
+        std::lock_guard<std::mutex> lock(workers[target]->mutex);
+        workers[target]->tasks.push_back(std::move(work));
+    }
+    // Counted under sleepMutex so that a worker can't check for work and go to sleep in between
+    {
+        std::lock_guard<std::mutex> lock(sleepMutex);
+        queued.fetch_add(1);
+    }
+    workAvailable.notify_one();
+}
+
+
+void workPool::wait() {
+    std::unique_lock<std::mutex> lock(sleepMutex);
+    allFinished.wait(lock, [this] { return unfinished.load() == 0; });
+}
+
+
+bool workPool::waitFor(std::chrono::milliseconds timeout) {
+    std::unique_lock<std::mutex> lock(sleepMutex);
+    return allFinished.wait_for(lock, timeout, [this] { return unfinished.load() == 0; });
+}
+
+
+bool workPool::take(size_t self, task& work) {
+    // The oldest task of this worker, or else the newest of the next worker that has one
+    for (size_t i = 0; i < workers.size(); ++i) {
+        worker& other = *workers[(self + i) % workers.size()];
+        std::lock_guard<std::mutex> lock(other.mutex);
+        if (other.tasks.empty()) continue;
+        if (i == 0) {
+            work = std::move(other.tasks.front());
+            other.tasks.pop_front();
+        } else {
+            work = std::move(other.tasks.back());
+            other.tasks.pop_back();
+        }
+        queued.fetch_sub(1);
+        return true;
+    }
+    return false;
+}
+
+
+void workPool::run(size_t self) {
+    currentPool = this;
+    currentWorker = self;
+    task work;
+    for (;;) {
+        if (take(self, work)) {
+            work();
+            work = nullptr;         // Destroy what the task captured before wait() can return
+            if (unfinished.fetch_sub(1) == 1) {
+                std::lock_guard<std::mutex> lock(sleepMutex);
+                allFinished.notify_all();
+            }
+            continue;
+        }
+        std::unique_lock<std::mutex> lock(sleepMutex);
+        workAvailable.wait(lock, [this] { return stopping || queued.load() > 0; });
+        if (stopping && queued.load() <= 0) return;
+    }
+}
@@ -0,0 +1,54 @@
+// A fixed set of worker threads with one task deque each. A worker runs the tasks in its own deque oldest first, and
+// when that is empty it steals the newest task of another worker. Running oldest first means that tasks which queue
+// their own continuation, like the streams of --multi, take turns on a worker instead of one of them keeping it.
+
+#ifndef WORK_POOL_H
+#define WORK_POOL_H
+
+#include <mutex>                    // Guards each deque
+#include <deque>                    // Per-worker tasks
+#include <atomic>                   // Counts of queued and unfinished tasks
+#include <memory>                   // std::unique_ptr for the workers
+#include <chrono>                   // Timeout of waitFor()
+#include <thread>                   // Worker threads
+#include <vector>                   // Workers
+#include <functional>               // Tasks
+#include <condition_variable>       // Idle workers and wait() sleep on these
+
+class workPool {
+public:
+    typedef std::function<void()> task;
+
+    explicit workPool(int threadCount);
+    workPool(const workPool&) = delete;
+    workPool& operator=(const workPool&) = delete;
+    ~workPool();                    // Runs the tasks still queued before it returns
+
+    // From a worker, the task goes to the back of that worker's deque. From any other thread the workers take turns
+    void submit(task work);
+    void wait();                    // Until every task, including the ones submitted meanwhile, has finished
+    // Like wait(), but gives up after timeout. Returns whether every task has finished
+    bool waitFor(std::chrono::milliseconds timeout);
+    int threads() const { return static_cast<int>(workers.size()); }
+
+private:
+    struct worker {
+        std::mutex mutex;
+        std::deque<task> tasks;
+    };
+
+    std::vector<std::unique_ptr<worker>> workers;
+    std::vector<std::thread> threadHandles;
+    std::atomic<long> queued{0};    // Tasks in the deques
+    std::atomic<long> unfinished{0};    // Tasks queued or running
+    std::atomic<unsigned> nextWorker{0};    // Deque for the next task submitted from outside the pool
+    bool stopping = false;
+    std::mutex sleepMutex;          // Guards stopping, and orders submit() against workers going to sleep
+    std::condition_variable workAvailable;
+    std::condition_variable allFinished;
+
+    bool take(size_t self, task& work);
+    void run(size_t self);
+};
+
+#endif